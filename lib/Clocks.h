@@ -0,0 +1,56 @@
+/*
+  Clocks - Time sources in microseconds for timestamping register writes
+  Released into the public domain
+*/
+
+#ifndef Clocks_h
+#define Clocks_h
+
+#include <stdint.h>
+
+#ifdef __AVR__
+#include <Arduino.h>
+#else
+#include <chrono>
+#endif
+
+
+namespace sid {
+
+#ifdef __AVR__
+struct MicrosClock {
+  static const uint32_t TICKS_PER_SECOND = 1000000;
+
+  uint32_t now() const {
+    return micros();
+  }
+};
+#else
+struct MicrosClock {
+  static const uint32_t TICKS_PER_SECOND = 1000000;
+
+  uint32_t now() const {
+    return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+};
+#endif
+
+// Clock that only moves when told to, for tests and offline rendering
+struct ManualClock {
+  static const uint32_t TICKS_PER_SECOND = 1000000;
+
+  explicit ManualClock(const uint32_t& t)
+    : time(t) {
+  }
+
+  uint32_t now() const {
+    return time;
+  }
+
+  const uint32_t& time;
+};
+
+} // namespace sid
+
+#endif
@@ -0,0 +1,277 @@
+/*
+  Instrumentation - Counts the register writes of Mos8561 and times the
+  Controller underneath. Define MOS8561_INSTRUMENTATION to enable it,
+  otherwise InstrumentedController only forwards and all counters read 0.
+  Define it for the whole project, e.g. in the compiler flags, rather than
+  in a source file. The two builds live in different inline namespaces, so
+  mixing them fails to link instead of breaking at runtime.
+  Released into the public domain
+*/
+
+#ifndef Instrumentation_h
+#define Instrumentation_h
+
+#include "Clocks.h"
+#include "Mos8561.h"
+
+#include <stdint.h>
+
+
+namespace sid {
+
+#ifdef MOS8561_INSTRUMENTATION
+inline namespace instrumented {
+#else
+inline namespace uninstrumented {
+#endif
+
+const uint8_t NUM_LATENCY_BUCKETS = 16;
+const uint8_t NUM_API_CALLS = uint8_t(ApiCall::Count);
+
+// Bucket 0 counts latencies of 0 ticks, bucket b those of 2^(b-1) to
+// 2^b - 1 ticks. The last bucket also takes everything above.
+class LatencyHistogram
+{
+public:
+  void add(const uint32_t ticks) {
+#ifdef MOS8561_INSTRUMENTATION
+    uint8_t bucket = 0;
+    for (uint32_t t = ticks; t != 0 && bucket < NUM_LATENCY_BUCKETS - 1; t >>= 1) {
+      ++bucket;
+    }
+    ++counts[bucket];
+    ++numSamples;
+    sum += ticks;
+    longestTicks = ticks > longestTicks ? ticks : longestTicks;
+#else
+    (void)ticks;
+#endif
+  }
+
+#ifdef MOS8561_INSTRUMENTATION
+  uint32_t count(const uint8_t bucket) const {
+    assert(bucket < NUM_LATENCY_BUCKETS);
+    return counts[bucket];
+  }
+
+  uint32_t samples() const {
+    return numSamples;
+  }
+
+  uint32_t total() const {
+    return sum;
+  }
+
+  uint32_t longest() const {
+    return longestTicks;
+  }
+
+  void reset() {
+    for (uint8_t i = 0; i < NUM_LATENCY_BUCKETS; ++i) {
+      counts[i] = 0;
+    }
+    numSamples = 0;
+    sum = 0;
+    longestTicks = 0;
+  }
+
+private:
+  uint32_t counts[NUM_LATENCY_BUCKETS] = {};
+  uint32_t numSamples = 0;
+  uint32_t sum = 0;
+  uint32_t longestTicks = 0;
+#else
+  uint32_t count(const uint8_t) const {
+    return 0;
+  }
+
+  uint32_t samples() const {
+    return 0;
+  }
+
+  uint32_t total() const {
+    return 0;
+  }
+
+  uint32_t longest() const {
+    return 0;
+  }
+
+  void reset() {
+  }
+#endif
+};
+
+// Counters shared by all copies of an InstrumentedController,
+// Mos8561 keeps a copy of its controller
+class ControllerStats
+{
+public:
+#ifdef MOS8561_INSTRUMENTATION
+  uint32_t writes(const uint8_t address) const {
+    assert(address < NUM_REGISTERS);
+    return addressWrites[address];
+  }
+
+  uint32_t writes(const ApiCall call) const {
+    assert(call < ApiCall::Count);
+    return callWrites[uint8_t(call)];
+  }
+
+  uint32_t calls(const ApiCall call) const {
+    assert(call < ApiCall::Count);
+    return callCounts[uint8_t(call)];
+  }
+
+  uint32_t totalWrites() const {
+    return numWrites;
+  }
+
+  void reset() {
+    for (uint8_t i = 0; i < NUM_REGISTERS; ++i) {
+      addressWrites[i] = 0;
+    }
+    for (uint8_t i = 0; i < NUM_API_CALLS; ++i) {
+      callWrites[i] = 0;
+      callCounts[i] = 0;
+    }
+    numWrites = 0;
+    writeLatency.reset();
+    burstLatency.reset();
+  }
+#else
+  uint32_t writes(const uint8_t) const {
+    return 0;
+  }
+
+  uint32_t writes(const ApiCall) const {
+    return 0;
+  }
+
+  uint32_t calls(const ApiCall) const {
+    return 0;
+  }
+
+  uint32_t totalWrites() const {
+    return 0;
+  }
+
+  void reset() {
+  }
+#endif
+
+  // Time spent in Controller::writeRegister per write and
+  // in Controller::writeRegisters per burst, in ticks of the clock
+  LatencyHistogram writeLatency;
+  LatencyHistogram burstLatency;
+
+private:
+  template<typename Inner, typename Clock>
+  friend class InstrumentedController;
+
+#ifdef MOS8561_INSTRUMENTATION
+  void enter(const ApiCall call) {
+    current = call;
+    ++callCounts[uint8_t(call)];
+  }
+
+  void count(const uint8_t address) {
+    if (address < NUM_REGISTERS) {
+      ++addressWrites[address];
+    }
+    ++callWrites[uint8_t(current)];
+    ++numWrites;
+  }
+
+  uint32_t addressWrites[NUM_REGISTERS] = {};
+  uint32_t callWrites[NUM_API_CALLS] = {};
+  uint32_t callCounts[NUM_API_CALLS] = {};
+  uint32_t numWrites = 0;
+  ApiCall current = ApiCall::Start;
+#endif
+};
+
+// Controller decorator that records into stats. Clock needs a method now(),
+// see Clocks.h, MicrosClock uses micros() on Arduino and steady_clock elsewhere.
+template<typename Inner, typename Clock = MicrosClock>
+class InstrumentedController
+{
+public:
+  InstrumentedController(Inner ctr, ControllerStats& s, Clock c = Clock())
+    : inner(ctr)
+#ifdef MOS8561_INSTRUMENTATION
+    , stats(s)
+    , clock(c) {
+#else
+  {
+    (void)s;
+    (void)c;
+#endif
+  }
+
+  void startClock() {
+    inner.startClock();
+  }
+
+  void reset() {
+    inner.reset();
+  }
+
+#ifdef MOS8561_INSTRUMENTATION
+  void enterApi(const ApiCall call) {
+    stats.enter(call);
+  }
+
+  void writeRegister(const uint8_t address, const uint8_t data) {
+    const uint32_t begin = clock.now();
+    inner.writeRegister(address, data);
+    stats.writeLatency.add(clock.now() - begin);
+    stats.count(address);
+  }
+
+  void writeRegisters(const uint8_t* addresses, const uint8_t* data, const uint8_t count) {
+    const uint32_t begin = clock.now();
+    forwardRegisters(inner, addresses, data, count, 0);
+    stats.burstLatency.add(clock.now() - begin);
+    for (uint8_t i = 0; i < count; ++i) {
+      stats.count(addresses[i]);
+    }
+  }
+#else
+  void writeRegister(const uint8_t address, const uint8_t data) {
+    inner.writeRegister(address, data);
+  }
+
+  void writeRegisters(const uint8_t* addresses, const uint8_t* data, const uint8_t count) {
+    forwardRegisters(inner, addresses, data, count, 0);
+  }
+#endif
+
+private:
+  template<typename C>
+  static auto forwardRegisters(C& ctr, const uint8_t* addresses, const uint8_t* data,
+      const uint8_t count, int)
+    -> decltype(ctr.writeRegisters(addresses, data, count), void()) {
+    ctr.writeRegisters(addresses, data, count);
+  }
+
+  template<typename C>
+  static void forwardRegisters(C& ctr, const uint8_t* addresses, const uint8_t* data,
+      const uint8_t count, long) {
+    for (uint8_t i = 0; i < count; ++i) {
+      ctr.writeRegister(addresses[i], data[i]);
+    }
+  }
+
+  Inner inner;
+#ifdef MOS8561_INSTRUMENTATION
+  ControllerStats& stats;
+  Clock clock;
+#endif
+};
+
+} // inline namespace
+
+} // namespace sid
+
+#endif
@@ -0,0 +1,202 @@
+/*
+  MidiInput - Streaming MIDI parser that plays incoming messages on a Mos8561
+  Released into the public domain
+*/
+
+#ifndef MidiInput_h
+#define MidiInput_h
+
+#include "Mos8561.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+namespace sid {
+
+// Controller numbers for the parameters of the chip. Provide a type with the
+// same members to MidiInput to use other numbers. Values must be unique.
+struct DefaultCcMap {
+  static const uint8_t VOLUME = 7;
+  static const uint8_t PULSE_WIDTH = 70;
+  static const uint8_t RELEASE = 72;
+  static const uint8_t ATTACK = 73;
+  static const uint8_t DECAY = 75;
+  static const uint8_t SUSTAIN = 79;
+  // Values of 64 and above route the voice through the filter
+  static const uint8_t FILTER = 80;
+};
+
+// Parses MIDI one byte at a time, e.g. straight from the serial port.
+// Channels starting at baseChannel play on voices 0 to 2, other channels are ignored.
+// Handles running status, skips system exclusive and system common messages and
+// lets realtime messages pass without disturbing a message in progress.
+template<typename Synth, typename CcMap = DefaultCcMap>
+class MidiInput
+{
+public:
+  static const uint8_t NO_NOTE = 0xff;
+
+  explicit MidiInput(Synth& s, const uint8_t baseChannel = 0)
+    : synth(s)
+    , firstChannel(baseChannel) {
+  }
+
+  // Range of the pitch bend wheel in either direction
+  void setPitchBendRange(const uint8_t semitones) {
+    bendRange = semitones;
+  }
+
+  void parse(const uint8_t byte) {
+    if (byte >= 0xf8) {
+      // Realtime messages may appear anywhere, even inside other messages
+      return;
+    }
+    if (byte & 0x80) {
+      startMessage(byte);
+      return;
+    }
+    if (isInSysEx || status == 0) {
+      return;
+    }
+    data[numData++] = byte;
+    if (numData < expectedData) {
+      return;
+    }
+    numData = 0;
+    if (status < 0xf0) {
+      dispatch();
+    } else {
+      // System common messages cancel running status
+      status = 0;
+    }
+  }
+
+  void parse(const uint8_t* bytes, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      parse(bytes[i]);
+    }
+  }
+
+  // Number of channel messages played so far
+  uint32_t numMessages() const {
+    return messageCount;
+  }
+
+private:
+  void startMessage(const uint8_t byte) {
+    numData = 0;
+    isInSysEx = byte == 0xf0;
+    if (byte == 0xf0 || byte == 0xf7) {
+      status = 0;
+      return;
+    }
+    status = byte;
+    switch (byte & 0xf0) {
+      case 0xc0:
+      case 0xd0:
+        expectedData = 1;
+        break;
+      case 0xf0:
+        // Song position takes two bytes, time code and song select one
+        expectedData = byte == 0xf2 ? 2 : byte == 0xf1 || byte == 0xf3 ? 1 : 0;
+        if (expectedData == 0) {
+          status = 0;
+        }
+        break;
+      default:
+        expectedData = 2;
+        break;
+    }
+  }
+
+  void dispatch() {
+    const uint8_t voiceNum = (uint8_t)((status & 0x0f) - firstChannel);
+    if (voiceNum >= 3) {
+      return;
+    }
+    ++messageCount;
+    uint8_t type = status & 0xf0;
+    if (type == 0x90 && data[1] == 0) {
+      // Note on with velocity 0 is a note off
+      type = 0x80;
+    }
+    switch (type) {
+      case 0x80:
+        // Only the note the voice is playing releases it
+        if (notes[voiceNum] == data[0]) {
+          notes[voiceNum] = NO_NOTE;
+          synth.playNote(voiceNum, (int)data[0], 0);
+        }
+        break;
+      case 0x90:
+        notes[voiceNum] = data[0];
+        synth.playNote(voiceNum, (int)data[0], data[1]);
+        break;
+      case 0xb0:
+        controlChange(voiceNum, data[0], data[1]);
+        break;
+      case 0xc0:
+        programChange(voiceNum, data[0]);
+        break;
+      case 0xe0: {
+        const int32_t wheel = (int32_t)(data[0] | (data[1] << 7)) - 8192;
+        synth.setPitchBend(voiceNum, (int16_t)((wheel * bendRange * PITCH_STEPS_PER_NOTE) >> 13));
+        break;
+      }
+    }
+  }
+
+  void controlChange(const uint8_t voiceNum, const uint8_t cc, const uint8_t value) {
+    Adsr adsr = synth.adsr(voiceNum);
+    switch (cc) {
+      case CcMap::VOLUME:
+        synth.setVolume(value);
+        return;
+      case CcMap::PULSE_WIDTH:
+        synth.setPulseWidth(voiceNum, value << 5);
+        return;
+      case CcMap::FILTER:
+        synth.setFilterIsEnabled(voiceNum, value >= 64);
+        return;
+      case CcMap::ATTACK:
+        adsr.att = value >> 3;
+        break;
+      case CcMap::DECAY:
+        adsr.dec = value >> 3;
+        break;
+      case CcMap::SUSTAIN:
+        adsr.sus = value >> 3;
+        break;
+      case CcMap::RELEASE:
+        adsr.rel = value >> 3;
+        break;
+      default:
+        return;
+    }
+    synth.setAdsr(voiceNum, adsr);
+  }
+
+  // Programs cycle through the four waveforms
+  void programChange(const uint8_t voiceNum, const uint8_t program) {
+    static const Waveform waveforms[4] = {
+      Waveform::Triangle, Waveform::Saw, Waveform::Square, Waveform::Noise
+    };
+    synth.setWaveform(voiceNum, waveforms[program & 3]);
+  }
+
+  Synth& synth;
+  const uint8_t firstChannel;
+  uint8_t bendRange = 2;
+  uint8_t status = 0;
+  uint8_t expectedData = 0;
+  uint8_t numData = 0;
+  uint8_t data[2];
+  bool isInSysEx = false;
+  uint32_t messageCount = 0;
+  uint8_t notes[3] = {NO_NOTE, NO_NOTE, NO_NOTE};
+};
+
+} // namespace sid
+
+#endif
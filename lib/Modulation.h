@@ -0,0 +1,178 @@
+/*
+  Modulation - Per voice LFOs and envelopes for Mos8561, advanced
+  in integer fixed point once per control tick
+  Released into the public domain
+*/
+
+#ifndef Modulation_h
+#define Modulation_h
+
+#include "Mos8561.h"
+
+#include <stdint.h>
+
+
+namespace sid {
+
+enum class LfoShape : uint8_t {
+  Triangle,
+  Saw,
+  Square,
+  SampleAndHold
+};
+
+// Phase increment per tick for an LFO running at hz when ticked tickRate times a second
+constexpr uint16_t lfoRate(const float hz, const uint16_t tickRate) {
+  return (uint16_t)(hz * 65536.f / tickRate + 0.5f);
+}
+
+// Level increment per tick for a full sweep of the envelope in the given seconds
+constexpr uint16_t envelopeRate(const float seconds, const uint16_t tickRate) {
+  return seconds * tickRate < 1.f ? 0xffff : (uint16_t)(65535.f / (seconds * tickRate) + 0.5f);
+}
+
+// Low frequency oscillator with a 16 bit phase, its output ranges from -128 to 127
+struct Lfo {
+  int8_t next() {
+    const uint16_t previous = phase;
+    phase += rate;
+    switch (shape) {
+      case LfoShape::Triangle: {
+        const uint16_t t = phase < 0x8000 ? phase : 0xffff - phase;
+        return (int8_t)((t >> 7) - 128);
+      }
+      case LfoShape::Saw:
+        return (int8_t)((phase >> 8) - 128);
+      case LfoShape::Square:
+        return phase < 0x8000 ? 127 : -128;
+      case LfoShape::SampleAndHold:
+        if (phase < previous) {
+          // 16 bit Galois LFSR, a new random value on every cycle
+          noise = (noise >> 1) ^ (-(noise & 1) & 0xb400);
+        }
+        return (int8_t)(noise & 0xff);
+    }
+    return 0;
+  }
+
+  LfoShape shape = LfoShape::Triangle;
+  uint16_t rate = 0;
+  uint16_t phase = 0;
+  uint16_t noise = 0xace1;
+};
+
+// Attack/release envelope that follows the gate of a voice, its output ranges from 0 to 255
+struct ModEnvelope {
+  uint8_t next() {
+    if (isGateOn) {
+      level = 0xffff - level <= attack ? 0xffff : level + attack;
+    } else {
+      level = level <= release ? 0 : level - release;
+    }
+    return level >> 8;
+  }
+
+  uint16_t attack = 0xffff;
+  uint16_t release = 0xffff;
+  uint16_t level = 0;
+  bool isGateOn = false;
+};
+
+// Modulates pitch and pulse width of the voices of a Mos8561. Depths are
+// given peak to peak for LFOs and for the fully opened envelope, pitch in
+// 1/256 semitone, pulse width in units of the 12 bit register. While a voice
+// is modulated its pitch bend and pulse width are owned by the engine.
+template<typename Synth>
+class ModulationEngine
+{
+public:
+  explicit ModulationEngine(Synth& s)
+    : synth(s) {
+  }
+
+  void setVibrato(const uint8_t voiceNum, const LfoShape shape, const uint16_t rate,
+      const int16_t depth) {
+    assert(voiceNum < 3);
+    voices[voiceNum].vibrato.shape = shape;
+    voices[voiceNum].vibrato.rate = rate;
+    voices[voiceNum].vibratoDepth = depth;
+  }
+
+  void setPulseWidthModulation(const uint8_t voiceNum, const LfoShape shape, const uint16_t rate,
+      const uint16_t center, const int16_t depth) {
+    assert(voiceNum < 3);
+    assert(center < 4096);
+    voices[voiceNum].pwm.shape = shape;
+    voices[voiceNum].pwm.rate = rate;
+    voices[voiceNum].pulseWidthCenter = center;
+    voices[voiceNum].pwmDepth = depth;
+  }
+
+  void setEnvelope(const uint8_t voiceNum, const uint16_t attack, const uint16_t release,
+      const int16_t toPitch, const int16_t toPulseWidth) {
+    assert(voiceNum < 3);
+    voices[voiceNum].envelope.attack = attack;
+    voices[voiceNum].envelope.release = release;
+    voices[voiceNum].envelopeToPitch = toPitch;
+    voices[voiceNum].envelopeToPulseWidth = toPulseWidth;
+  }
+
+  // Call along with note on and off so that the envelope follows the voice
+  void gate(const uint8_t voiceNum, const bool isOn) {
+    assert(voiceNum < 3);
+    voices[voiceNum].envelope.isGateOn = isOn;
+  }
+
+  // Advances all modulators by one step and writes what changed
+  void tick() {
+    for (uint8_t v = 0; v < 3; ++v) {
+      VoiceModulation& mod = voices[v];
+      const int16_t env = mod.envelope.next();
+      const int16_t vibrato = mod.vibrato.next();
+      const int16_t pwm = mod.pwm.next();
+      if (mod.vibratoDepth != 0 || mod.envelopeToPitch != 0) {
+        const int16_t bend = scale(vibrato, mod.vibratoDepth) + scale(env, mod.envelopeToPitch);
+        if (bend != mod.bend) {
+          mod.bend = bend;
+          synth.setPitchBend(v, bend);
+        }
+      }
+      if (mod.pwmDepth != 0 || mod.envelopeToPulseWidth != 0) {
+        int32_t width = (int32_t)mod.pulseWidthCenter + scale(pwm, mod.pwmDepth)
+          + scale(env, mod.envelopeToPulseWidth);
+        width = width < 0 ? 0 : width > 4095 ? 4095 : width;
+        if (width != mod.pulseWidth) {
+          mod.pulseWidth = width;
+          synth.setPulseWidth(v, width);
+        }
+      }
+    }
+  }
+
+private:
+  struct VoiceModulation {
+    Lfo vibrato;
+    Lfo pwm;
+    ModEnvelope envelope;
+    int16_t vibratoDepth = 0;
+    int16_t pwmDepth = 0;
+    int16_t envelopeToPitch = 0;
+    int16_t envelopeToPulseWidth = 0;
+    uint16_t pulseWidthCenter = 2048;
+    // Last values sent to the chip
+    int16_t bend = 0;
+    int16_t pulseWidth = -1;
+  };
+
+  // Value of -128 to 255 in units of 1/256 depth
+  static int16_t scale(const int16_t value, const int16_t depth) {
+    return (int16_t)(((int32_t)value * depth) >> 8);
+  }
+
+  Synth& synth;
+  VoiceModulation voices[3];
+};
+
+} // namespace sid
+
+#endif
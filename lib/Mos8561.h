@@ -7,13 +7,63 @@
 #ifndef Mos8561_h
 #define Mos8561_h
 
+#include "NoteTable.h"
+
 #include <assert.h>
-#include <math.h>
+#include <stdint.h>
 
 
 namespace sid {
 
-const int REF_A = 440;
+// Number of registers in the chip's address space (0x00 - 0x1C)
+const uint8_t NUM_REGISTERS = 29;
+
+// Offsets of the seven registers of each voice
+const uint8_t FREQ_LO = 0;
+const uint8_t FREQ_HI = 1;
+const uint8_t PW_LO = 2;
+const uint8_t PW_HI = 3;
+const uint8_t CONTROL = 4;
+const uint8_t ATTACK_DECAY = 5;
+const uint8_t SUSTAIN_RELEASE = 6;
+
+// Registers shared by all voices
+const uint8_t FILTER_CUTOFF_LO = 0x15;
+const uint8_t FILTER_CUTOFF_HI = 0x16;
+const uint8_t RESONANCE_ROUTING = 0x17;
+const uint8_t MODE_VOLUME = 0x18;
+
+// Read-only registers
+const uint8_t POT_X = 0x19;
+const uint8_t POT_Y = 0x1A;
+const uint8_t OSC3 = 0x1B;
+const uint8_t ENV3 = 0x1C;
+
+const uint16_t MAX_FILTER_CUTOFF = 2047;
+
+constexpr uint8_t voiceRegister(const uint8_t voiceNum, const uint8_t offset) {
+  return voiceNum * 7 + offset;
+}
+
+// Register addresses of a voice as compile-time constants
+template<uint8_t VoiceNum>
+struct VoiceRegisters {
+  static_assert(VoiceNum < 3, "The chip has three voices");
+  static const uint8_t BASE = voiceRegister(VoiceNum, 0);
+  static const uint8_t FREQ_LO = voiceRegister(VoiceNum, sid::FREQ_LO);
+  static const uint8_t FREQ_HI = voiceRegister(VoiceNum, sid::FREQ_HI);
+  static const uint8_t PW_LO = voiceRegister(VoiceNum, sid::PW_LO);
+  static const uint8_t PW_HI = voiceRegister(VoiceNum, sid::PW_HI);
+  static const uint8_t CONTROL = voiceRegister(VoiceNum, sid::CONTROL);
+  static const uint8_t ATTACK_DECAY = voiceRegister(VoiceNum, sid::ATTACK_DECAY);
+  static const uint8_t SUSTAIN_RELEASE = voiceRegister(VoiceNum, sid::SUSTAIN_RELEASE);
+  static const uint8_t FILTER_MASK = 1 << VoiceNum;
+};
+
+// Number of writes a transaction queues before it has to flush early
+#ifndef MOS8561_TRANSACTION_SIZE
+#define MOS8561_TRANSACTION_SIZE 32
+#endif
 
 enum class Waveform : uint8_t {
   Noise = 0x80,
@@ -22,6 +72,24 @@ enum class Waveform : uint8_t {
   Triangle = 0x10
 };
 
+// Filter outputs mixed into the output, the modes can be combined with |
+enum class FilterMode : uint8_t {
+  Off = 0x00,
+  LowPass = 0x10,
+  BandPass = 0x20,
+  HighPass = 0x40,
+  Notch = 0x50
+};
+
+constexpr FilterMode operator|(const FilterMode a, const FilterMode b) {
+  return FilterMode(uint8_t(a) | uint8_t(b));
+}
+
+// Bits of the control register besides waveform and gate
+const uint8_t CONTROL_SYNC = 0x02;
+const uint8_t CONTROL_RING_MOD = 0x04;
+const uint8_t CONTROL_TEST = 0x08;
+
 struct Adsr {
   uint8_t att;
   uint8_t dec;
@@ -29,6 +97,52 @@ struct Adsr {
   uint8_t rel;
 };
 
+// Sound of a voice packed into 5 bytes, laid out like the chip's registers,
+// so that a bank of a few hundred patches fits into the flash of an MCU.
+// Declare banks as const Patch bank[] MOS8561_PROGMEM = {makePatch(...), ...}
+// and pass isInFlash to Mos8561::setPatchBank.
+struct Patch {
+  // Waveform in the upper nibble, sync and ring modulation in bits 1 and 2
+  // like in the control register, bit 0 routes the voice through the filter
+  uint8_t waveformFilter;
+  uint8_t attackDecay;
+  uint8_t sustainRelease;
+  uint8_t pulseWidthLo;
+  uint8_t pulseWidthHi;
+};
+
+constexpr Patch makePatch(const Waveform waveform, const Adsr adsr, const uint16_t pulseWidth,
+    const bool filterIsEnabled, const bool isSynced = false, const bool isRingModulated = false) {
+  return Patch{
+    (uint8_t)(uint8_t(waveform) | (isSynced ? CONTROL_SYNC : 0)
+      | (isRingModulated ? CONTROL_RING_MOD : 0) | filterIsEnabled),
+    (uint8_t)((adsr.att << 4) | (adsr.dec & 0xf)),
+    (uint8_t)((adsr.sus << 4) | (adsr.rel & 0xf)),
+    (uint8_t)(pulseWidth & 0xff),
+    (uint8_t)((pulseWidth >> 8) & 0xf)
+  };
+}
+
+// Public entry points of Mos8561. A Controller with a method
+// enterApi(ApiCall) is told which one the following writes come from,
+// e.g. InstrumentedController (see Instrumentation.h).
+enum class ApiCall : uint8_t {
+  Start,
+  SetVolume,
+  SetAdsr,
+  SetWaveform,
+  SetPulseWidth,
+  SetFilterIsEnabled,
+  PlayNote,
+  SetPitchBend,
+  SetFilter,
+  SetControlBits,
+  ApplyPatch,
+  // Writes queued by a transaction are sent by its commit
+  Commit,
+  Count
+};
+
 // This type must be implemented and injected into Mos8561
 // It defines how the Mos8561 chip is connected to the Arduino
 struct Controller {
@@ -36,23 +150,44 @@ struct Controller {
   void startClock(); 
   void reset();
   void writeRegister(const uint8_t address, const uint8_t data);
+  // Optional, used to send a committed transaction in one burst if present
+  void writeRegisters(const uint8_t* addresses, const uint8_t* data, const uint8_t count);
+  // Optional, called at the start of every public method that may write
+  void enterApi(const ApiCall call);
+  // Optional, only needed for reading OSC3, ENV3 and the paddles
+  uint8_t readRegister(const uint8_t address);
 };
 
 namespace {
-  float noteToFreq(const float note) {
-    return REF_A * pow(2, (note - 69) / 12.f);
-  }
-
-  uint16_t freqAsWord(const float freq) {
-    return (uint16_t)round(freq / 0.0596);
-  }
-
   uint8_t byteTo4Bits(const int val) {
     return (uint8_t)(val * 15 / 127.f);
   }
+
+  Patch readPatch(const Patch* patch, const bool isInFlash) {
+#ifdef __AVR__
+    if (isInFlash) {
+      Patch p;
+      memcpy_P(&p, patch, sizeof(Patch));
+      return p;
+    }
+#else
+    (void)isInFlash;
+#endif
+    return *patch;
+  }
 }; // unnamed namespace
 
-template<typename Controller>
+// Defining MOS8561_COUNT_SUPPRESSED_WRITES adds a counter to Mos8561, so it
+// must be set for the whole project, e.g. in the compiler flags. The two
+// layouts live in different inline namespaces and cannot be mixed up.
+#ifdef MOS8561_COUNT_SUPPRESSED_WRITES
+inline namespace counting {
+#else
+inline namespace plain {
+#endif
+
+// Clock is the rate in Hz the chip is driven with (see NoteTable.h)
+template<typename Controller, uint32_t Clock = CLOCK_1MHZ>
 class Mos8561
 {
 public:
@@ -60,101 +195,510 @@ public:
     controller(ctr) {
   }
 
+  // Writes queued by an open transaction are dropped, they were meant
+  // for the chip before the reset. The transaction itself stays open.
   void start() {
+    announce(ApiCall::Start);
     controller.startClock();
     controller.reset();
+    // After a reset all registers of the chip are cleared
+    for (uint8_t i = 0; i < NUM_REGISTERS; ++i) {
+      registers[i] = 0;
+    }
+    validRegisters = ALL_REGISTERS_VALID;
+    numQueued = 0;
+  }
+
+  // Forget what the chip holds, so that every following write is sent.
+  // Use this if the chip has been reset or written to behind our back.
+  // Writes queued by an open transaction are still sent on commit().
+  void invalidate() {
+    validRegisters = 0;
+  }
+
+  // Queues all writes until the matching commit() and sends them together.
+  // Transactions can be nested, only the outermost commit() sends.
+  void begin() {
+    ++transactionDepth;
+  }
+
+  void commit() {
+    announce(ApiCall::Commit);
+    endTransaction();
+  }
+
+  // Runs a transaction for as long as it lives
+  class Transaction {
+  public:
+    explicit Transaction(Mos8561& mos)
+      : chip(mos) {
+      chip.begin();
+    }
+
+    ~Transaction() {
+      chip.commit();
+    }
+
+    Transaction(const Transaction&) = delete;
+    Transaction& operator=(const Transaction&) = delete;
+
+  private:
+    Mos8561& chip;
+  };
+
+#ifdef MOS8561_COUNT_SUPPRESSED_WRITES
+  uint32_t suppressedWrites() const {
+    return numSuppressedWrites;
   }
+#endif
 
   void setVolume(const uint8_t vol) {
+    announce(ApiCall::SetVolume);
     volume = vol;
-    uint8_t data = byteTo4Bits(volume);
-    uint8_t address = 0x18;
-    controller.writeRegister(address, data);
+    writeModeVolume();
+  }
+
+  // Filter settings share registers with volume and routing, the other
+  // halves come from cached state, so nothing is ever read back from the bus
+
+  // Cutoff has 11 bits. A sweep writes only the bytes that change, mostly
+  // one and at most two per update.
+  void setFilterCutoff(const uint16_t cutoff) {
+    announce(ApiCall::SetFilter);
+    assert(cutoff <= MAX_FILTER_CUTOFF);
+    filterCutoff = cutoff;
+    writeRegister(FILTER_CUTOFF_LO, (uint8_t)(filterCutoff & 0x7));
+    writeRegister(FILTER_CUTOFF_HI, (uint8_t)(filterCutoff >> 3));
+  }
+
+  void setFilterResonance(const uint8_t res) {
+    announce(ApiCall::SetFilter);
+    assert(res < 16);
+    resonance = res;
+    writeFilterRouting();
   }
 
+  void setFilterMode(const FilterMode mode) {
+    announce(ApiCall::SetFilter);
+    filterMode = mode;
+    writeModeVolume();
+  }
+
+  // Silences voice 3 unless it is routed through the filter,
+  // e.g. to use OSC3 or ENV3 as a modulation source only
+  void setVoice3IsMuted(const bool isMuted) {
+    announce(ApiCall::SetFilter);
+    isVoice3Muted = isMuted;
+    writeModeVolume();
+  }
+
+  uint16_t filterCutoffValue() const {
+    return filterCutoff;
+  }
+
+  // The oscillator and the envelope of voice 3 as the chip reads them out,
+  // they change continuously and are always read from the bus. These and
+  // paddle() need Controller::readRegister, they are only compiled when used.
+  // Reads are not queued, so within a transaction they happen right away.
+  uint8_t oscillator3() {
+    return controller.readRegister(OSC3);
+  }
+
+  uint8_t envelope3() {
+    return controller.readRegister(ENV3);
+  }
+
+  uint8_t paddle(const uint8_t paddleNum) {
+    assert(paddleNum < 2);
+    return controller.readRegister(POT_X + paddleNum);
+  }
+
+  // The setters below come in two flavours. The ones taking the voice as a
+  // template argument check it at compile time and let the compiler fold
+  // all register addresses to constants, e.g. setAdsr<1>(adsr).
+
   void setAdsr(const uint8_t voiceNum, const Adsr adsr) {
-    voices[voiceNum].adsr = adsr;
-    // 1. Attack/Release
-    uint8_t address = 5 + (voiceNum * 7);
-    uint8_t data = voices[voiceNum].adsr.dec + (voices[voiceNum].adsr.att << 4);
-    controller.writeRegister(address, data);
-    // 2. Release/Sustain
-    ++address;
-    data = voices[voiceNum].adsr.rel + (voices[voiceNum].adsr.sus << 4);
-    controller.writeRegister(address, data);
+    announce(ApiCall::SetAdsr);
+    assert(voiceNum < 3);
+    writeAdsr(voiceRegister(voiceNum, 0), voices[voiceNum], adsr);
+  }
+
+  template<uint8_t VoiceNum>
+  void setAdsr(const Adsr adsr) {
+    announce(ApiCall::SetAdsr);
+    static_assert(VoiceNum < 3, "The chip has three voices");
+    writeAdsr(VoiceRegisters<VoiceNum>::BASE, voices[VoiceNum], adsr);
+  }
+
+  Adsr adsr(const uint8_t voiceNum) const {
+    assert(voiceNum < 3);
+    return voices[voiceNum].adsr;
   }
 
   void setWaveform(const uint8_t voiceNum, const Waveform waveform) {
+    announce(ApiCall::SetWaveform);
+    assert(voiceNum < 3);
     voices[voiceNum].waveform = waveform;
-    writeControlByte(voiceNum);
+    writeControlByte(voiceRegister(voiceNum, 0), voices[voiceNum]);
+  }
+
+  template<uint8_t VoiceNum>
+  void setWaveform(const Waveform waveform) {
+    announce(ApiCall::SetWaveform);
+    static_assert(VoiceNum < 3, "The chip has three voices");
+    voices[VoiceNum].waveform = waveform;
+    writeControlByte(VoiceRegisters<VoiceNum>::BASE, voices[VoiceNum]);
   }
 
   void setPulseWidth(const uint8_t voiceNum, const uint16_t width) {
+    announce(ApiCall::SetPulseWidth);
+    assert(voiceNum < 3);
     assert(width < 4096);
-    voices[voiceNum].pulseWidth = width;
-    // Lower byte of 12-bit value
-    uint8_t data = (uint8_t)(voices[voiceNum].pulseWidth & 0xff);
-    uint8_t address = 2 + (voiceNum * 7);
-    controller.writeRegister(address, data);
-    // Upper four bits of 12-bit value
-    data = (uint8_t)(voices[voiceNum].pulseWidth >> 8);
-    ++address;
-    controller.writeRegister(address, data);
+    writePulseWidth(voiceRegister(voiceNum, 0), voices[voiceNum], width);
+  }
+
+  template<uint8_t VoiceNum>
+  void setPulseWidth(const uint16_t width) {
+    announce(ApiCall::SetPulseWidth);
+    static_assert(VoiceNum < 3, "The chip has three voices");
+    assert(width < 4096);
+    writePulseWidth(VoiceRegisters<VoiceNum>::BASE, voices[VoiceNum], width);
+  }
+
+  template<uint8_t VoiceNum, uint16_t Width>
+  void setPulseWidth() {
+    announce(ApiCall::SetPulseWidth);
+    static_assert(VoiceNum < 3, "The chip has three voices");
+    static_assert(Width < 4096, "The pulse width has 12 bits");
+    writePulseWidth(VoiceRegisters<VoiceNum>::BASE, voices[VoiceNum], Width);
   }
 
   void setFilterIsEnabled(const uint8_t voiceNum, const bool isEnabled) {
+    announce(ApiCall::SetFilterIsEnabled);
+    assert(voiceNum < 3);
     voices[voiceNum].filterIsEnabled = isEnabled;
-    const uint8_t address = 23;
-    const uint8_t data = voices[0].filterIsEnabled + (voices[1].filterIsEnabled << 1)
-      + (voices[2].filterIsEnabled << 2);
-    controller.writeRegister(address, data);
+    writeFilterRouting();
+  }
+
+  template<uint8_t VoiceNum>
+  void setFilterIsEnabled(const bool isEnabled) {
+    announce(ApiCall::SetFilterIsEnabled);
+    static_assert(VoiceNum < 3, "The chip has three voices");
+    voices[VoiceNum].filterIsEnabled = isEnabled;
+    writeFilterRouting();
+  }
+
+  // Note can be of any integral or floating point type, fractional notes
+  // are rounded to 1/256 semitone
+  template<typename Note>
+  void playNote(const uint8_t voiceNum, const Note note, const uint8_t velocity) {
+    playPitch(voiceNum, noteAsPitch(note), velocity);
+  }
+
+  template<uint8_t VoiceNum, typename Note>
+  void playNote(const Note note, const uint8_t velocity) {
+    playPitch<VoiceNum>(noteAsPitch(note), velocity);
   }
 
-  void playNote(const uint8_t voiceNum, const double note, const uint8_t velocity) {
+  // Pitch is an 8.8 fixed point note number
+  void playPitch(const uint8_t voiceNum, const int16_t pitch, const uint8_t velocity) {
+    announce(ApiCall::PlayNote);
     assert(voiceNum < 3);
-    voices[voiceNum].isPlaying = velocity > 0;
-    const auto hz = noteToFreq(note);
-    writeFrequency(voiceNum, hz);
-    writeControlByte(voiceNum);
+    writeNote(voiceRegister(voiceNum, 0), voices[voiceNum], pitch, velocity);
   }
 
-private:
-  void writeFrequency(const uint8_t voiceNum, const float hz) {
-    uint16_t freq = freqAsWord(hz);
-    // 1. Freq Lo
-    uint8_t address = voiceNum * 7;
-    uint8_t data = (uint8_t)(freq & 0xff);
-    controller.writeRegister(address, data);
-    // 1. Freq Lo
-    address += 1;
-    data = (uint8_t)(freq >> 8);
-    controller.writeRegister(address, data);
+  template<uint8_t VoiceNum>
+  void playPitch(const int16_t pitch, const uint8_t velocity) {
+    announce(ApiCall::PlayNote);
+    static_assert(VoiceNum < 3, "The chip has three voices");
+    writeNote(VoiceRegisters<VoiceNum>::BASE, voices[VoiceNum], pitch, velocity);
   }
 
-  void writeControlByte(const uint8_t voiceNum) {
-    uint8_t data = uint8_t(voices[voiceNum].waveform) + voices[voiceNum].isPlaying;
-    uint8_t address = 4 + (voiceNum * 7);
-    controller.writeRegister(address, data);
+  // Bend is given in 1/256 semitone and added to the pitch of every following note
+  void setPitchBend(const uint8_t voiceNum, const int16_t bend) {
+    announce(ApiCall::SetPitchBend);
+    assert(voiceNum < 3);
+    voices[voiceNum].pitchBend = bend;
+    writeFrequency(voiceRegister(voiceNum, 0), voices[voiceNum]);
   }
 
-  void writeRegister(const uint8_t address, const uint8_t data) {
-    controller.writeRegister(address, data);
+  template<uint8_t VoiceNum>
+  void setPitchBend(const int16_t bend) {
+    announce(ApiCall::SetPitchBend);
+    static_assert(VoiceNum < 3, "The chip has three voices");
+    voices[VoiceNum].pitchBend = bend;
+    writeFrequency(VoiceRegisters<VoiceNum>::BASE, voices[VoiceNum]);
+  }
+
+  // Hard syncs the oscillator of the voice to the one of the voice before it
+  // (voice 2 for voice 0), which should then play the lower frequency
+  void setSync(const uint8_t voiceNum, const bool isOn) {
+    assert(voiceNum < 3);
+    writeControlBit(voiceRegister(voiceNum, 0), voices[voiceNum], CONTROL_SYNC, isOn);
+  }
+
+  template<uint8_t VoiceNum>
+  void setSync(const bool isOn) {
+    static_assert(VoiceNum < 3, "The chip has three voices");
+    writeControlBit(VoiceRegisters<VoiceNum>::BASE, voices[VoiceNum], CONTROL_SYNC, isOn);
+  }
+
+  // Replaces the triangle of the voice with its ring modulation
+  // by the oscillator of the voice before it
+  void setRingModulation(const uint8_t voiceNum, const bool isOn) {
+    assert(voiceNum < 3);
+    writeControlBit(voiceRegister(voiceNum, 0), voices[voiceNum], CONTROL_RING_MOD, isOn);
+  }
+
+  template<uint8_t VoiceNum>
+  void setRingModulation(const bool isOn) {
+    static_assert(VoiceNum < 3, "The chip has three voices");
+    writeControlBit(VoiceRegisters<VoiceNum>::BASE, voices[VoiceNum], CONTROL_RING_MOD, isOn);
+  }
+
+  // Holds the oscillator at zero while on
+  void setTest(const uint8_t voiceNum, const bool isOn) {
+    assert(voiceNum < 3);
+    writeControlBit(voiceRegister(voiceNum, 0), voices[voiceNum], CONTROL_TEST, isOn);
   }
 
+  template<uint8_t VoiceNum>
+  void setTest(const bool isOn) {
+    static_assert(VoiceNum < 3, "The chip has three voices");
+    writeControlBit(VoiceRegisters<VoiceNum>::BASE, voices[VoiceNum], CONTROL_TEST, isOn);
+  }
+
+  // The bank stays where it is and must outlive the Mos8561. On AVR a bank
+  // declared MOS8561_PROGMEM must be passed with isInFlash.
+  void setPatchBank(const Patch* bank, const uint16_t count, const bool isInFlash = false) {
+    patchBank = bank;
+    numPatches = count;
+    isPatchBankInFlash = isInFlash;
+  }
+
+  template<uint16_t Count>
+  void setPatchBank(const Patch (&bank)[Count], const bool isInFlash = false) {
+    setPatchBank(bank, Count, isInFlash);
+  }
+
+  uint16_t patchCount() const {
+    return numPatches;
+  }
+
+  // Switches the sound of a voice without touching the note it plays.
+  // Only the registers that change are written, all in one transaction,
+  // so this is cheap enough to do mid-phrase.
+  void applyPatch(const uint8_t voiceNum, const uint16_t patchId) {
+    assert(voiceNum < 3);
+    assert(patchId < numPatches);
+    writePatch(voiceRegister(voiceNum, 0), voices[voiceNum],
+      readPatch(patchBank + patchId, isPatchBankInFlash));
+  }
+
+  template<uint8_t VoiceNum>
+  void applyPatch(const uint16_t patchId) {
+    static_assert(VoiceNum < 3, "The chip has three voices");
+    assert(patchId < numPatches);
+    writePatch(VoiceRegisters<VoiceNum>::BASE, voices[VoiceNum],
+      readPatch(patchBank + patchId, isPatchBankInFlash));
+  }
+
+  void applyPatch(const uint8_t voiceNum, const Patch& patch) {
+    assert(voiceNum < 3);
+    writePatch(voiceRegister(voiceNum, 0), voices[voiceNum], patch);
+  }
+
+private:
   struct Voice {
     uint8_t num;
-    Waveform waveform;
-    uint16_t pulseWidth;
-    Adsr adsr;
+    Waveform waveform = Waveform(0);
+    uint16_t pulseWidth = 0;
+    Adsr adsr = {0, 0, 0, 0};
+    int16_t pitch = 0;
+    int16_t pitchBend = 0;
+    // Sync, ring modulation and test
+    uint8_t controlBits = 0;
     bool filterIsEnabled = false;
     bool isPlaying = false;
   };
-  
+
+  // The helpers that address a voice take its first register. The template
+  // flavours pass a constant, which folds all addresses once inlined.
+
+  void writePatch(const uint8_t base, Voice& voice, const Patch& patch) {
+    announce(ApiCall::ApplyPatch);
+    const Waveform waveform = Waveform(patch.waveformFilter & 0xf0);
+    const uint8_t controlBits = (voice.controlBits & CONTROL_TEST)
+      | (patch.waveformFilter & (CONTROL_SYNC | CONTROL_RING_MOD));
+    const Adsr adsr = {
+      (uint8_t)(patch.attackDecay >> 4), (uint8_t)(patch.attackDecay & 0xf),
+      (uint8_t)(patch.sustainRelease >> 4), (uint8_t)(patch.sustainRelease & 0xf)
+    };
+    const uint16_t pulseWidth = patch.pulseWidthLo | ((patch.pulseWidthHi & 0xf) << 8);
+    // The shadow registers drop the bytes the chip already holds
+    begin();
+    voice.waveform = waveform;
+    voice.controlBits = controlBits;
+    writeControlByte(base, voice);
+    writeAdsr(base, voice, adsr);
+    writePulseWidth(base, voice, pulseWidth);
+    voice.filterIsEnabled = patch.waveformFilter & 1;
+    writeFilterRouting();
+    endTransaction();
+  }
+
+  void endTransaction() {
+    assert(transactionDepth > 0);
+    if (--transactionDepth == 0) {
+      flush();
+    }
+  }
+
+  void announce(const ApiCall call) {
+    enterApi(controller, call, 0);
+  }
+
+  template<typename C>
+  static auto enterApi(C& ctr, const ApiCall call, int) -> decltype(ctr.enterApi(call), void()) {
+    ctr.enterApi(call);
+  }
+
+  template<typename C>
+  static void enterApi(C&, const ApiCall, long) {
+  }
+
+  void writeAdsr(const uint8_t base, Voice& voice, const Adsr adsr) {
+    voice.adsr = adsr;
+    // 1. Attack/Decay
+    uint8_t data = adsr.dec + (adsr.att << 4);
+    writeRegister(base + ATTACK_DECAY, data);
+    // 2. Sustain/Release
+    data = adsr.rel + (adsr.sus << 4);
+    writeRegister(base + SUSTAIN_RELEASE, data);
+  }
+
+  void writePulseWidth(const uint8_t base, Voice& voice, const uint16_t width) {
+    voice.pulseWidth = width;
+    // Lower byte of 12-bit value
+    uint8_t data = (uint8_t)(width & 0xff);
+    writeRegister(base + PW_LO, data);
+    // Upper four bits of 12-bit value
+    data = (uint8_t)(width >> 8);
+    writeRegister(base + PW_HI, data);
+  }
+
+  void writeFilterRouting() {
+    const uint8_t address = RESONANCE_ROUTING;
+    const uint8_t data = (voices[0].filterIsEnabled ? VoiceRegisters<0>::FILTER_MASK : 0)
+      | (voices[1].filterIsEnabled ? VoiceRegisters<1>::FILTER_MASK : 0)
+      | (voices[2].filterIsEnabled ? VoiceRegisters<2>::FILTER_MASK : 0) | (resonance << 4);
+    writeRegister(address, data);
+  }
+
+  void writeModeVolume() {
+    const uint8_t data = byteTo4Bits(volume) | uint8_t(filterMode) | (isVoice3Muted ? 0x80 : 0);
+    writeRegister(MODE_VOLUME, data);
+  }
+
+  void writeControlBit(const uint8_t base, Voice& voice, const uint8_t bit, const bool isOn) {
+    announce(ApiCall::SetControlBits);
+    voice.controlBits = isOn ? (uint8_t)(voice.controlBits | bit) : (uint8_t)(voice.controlBits & ~bit);
+    writeControlByte(base, voice);
+  }
+
+  void writeNote(const uint8_t base, Voice& voice, const int16_t pitch, const uint8_t velocity) {
+    voice.isPlaying = velocity > 0;
+    voice.pitch = pitch;
+    writeFrequency(base, voice);
+    writeControlByte(base, voice);
+  }
+
+  void writeFrequency(const uint8_t base, const Voice& voice) {
+    const uint16_t freq = pitchAsWord<Clock>((int32_t)voice.pitch + voice.pitchBend);
+    // 1. Freq Lo
+    uint8_t data = (uint8_t)(freq & 0xff);
+    writeRegister(base + FREQ_LO, data);
+    // 2. Freq Hi
+    data = (uint8_t)(freq >> 8);
+    writeRegister(base + FREQ_HI, data);
+  }
+
+  void writeControlByte(const uint8_t base, const Voice& voice) {
+    const uint8_t data = uint8_t(voice.waveform) + voice.controlBits + voice.isPlaying;
+    writeRegister(base + CONTROL, data);
+  }
+
+  void writeRegister(const uint8_t address, const uint8_t data) {
+    // Skip the write if the chip already holds the data
+    const uint32_t mask = uint32_t(1) << address;
+    if ((validRegisters & mask) && registers[address] == data) {
+#ifdef MOS8561_COUNT_SUPPRESSED_WRITES
+      ++numSuppressedWrites;
+#endif
+      return;
+    }
+    registers[address] = data;
+    validRegisters |= mask;
+    if (transactionDepth == 0) {
+      controller.writeRegister(address, data);
+      return;
+    }
+    if (numQueued == MOS8561_TRANSACTION_SIZE) {
+      flush();
+    }
+    queuedAddresses[numQueued] = address;
+    queuedData[numQueued] = data;
+    ++numQueued;
+  }
+
+  void flush() {
+    if (numQueued > 0) {
+      writeQueued(controller, 0);
+      numQueued = 0;
+    }
+  }
+
+  // Picked if the controller can send several registers at once
+  template<typename C>
+  auto writeQueued(C& ctr, int)
+    -> decltype(ctr.writeRegisters((const uint8_t*)0, (const uint8_t*)0, uint8_t(0)), void()) {
+    ctr.writeRegisters(queuedAddresses, queuedData, numQueued);
+  }
+
+  template<typename C>
+  void writeQueued(C& ctr, long) {
+    for (uint8_t i = 0; i < numQueued; ++i) {
+      ctr.writeRegister(queuedAddresses[i], queuedData[i]);
+    }
+  }
+
+  static const uint32_t ALL_REGISTERS_VALID = (uint32_t(1) << NUM_REGISTERS) - 1;
+
   Controller controller;
   Voice voices[3];
-  uint8_t volume;
+  uint8_t volume = 0;
+  uint16_t filterCutoff = 0;
+  uint8_t resonance = 0;
+  FilterMode filterMode = FilterMode::Off;
+  bool isVoice3Muted = false;
+  // Shadow copy of the chip's registers, only meaningful where the
+  // corresponding bit in validRegisters is set
+  uint8_t registers[NUM_REGISTERS];
+  uint32_t validRegisters = 0;
+  const Patch* patchBank = nullptr;
+  uint16_t numPatches = 0;
+  bool isPatchBankInFlash = false;
+  uint8_t transactionDepth = 0;
+  uint8_t numQueued = 0;
+  uint8_t queuedAddresses[MOS8561_TRANSACTION_SIZE];
+  uint8_t queuedData[MOS8561_TRANSACTION_SIZE];
+#ifdef MOS8561_COUNT_SUPPRESSED_WRITES
+  uint32_t numSuppressedWrites = 0;
+#endif
 };
 
+} // inline namespace
+
 } // namespace sid
 
 #endif
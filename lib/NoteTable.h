@@ -0,0 +1,137 @@
+/*
+  NoteTable - Compile-time tables of the Mos8561 frequency words for all MIDI notes
+  Released into the public domain
+*/
+
+#ifndef NoteTable_h
+#define NoteTable_h
+
+#include <stdint.h>
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#define MOS8561_PROGMEM PROGMEM
+#else
+#define MOS8561_PROGMEM
+#endif
+
+
+namespace sid {
+
+const int REF_A = 440;
+
+// Clock rates the chip is commonly driven with
+const uint32_t CLOCK_1MHZ = 1000000;
+const uint32_t CLOCK_PAL = 985248;
+const uint32_t CLOCK_NTSC = 1022727;
+
+const uint8_t NUM_NOTES = 128;
+
+// Pitches are 8.8 fixed point MIDI note numbers,
+// i.e. one semitone is divided into 256 steps
+const int16_t PITCH_STEPS_PER_NOTE = 256;
+
+namespace {
+  // Everything below must stay within the single-return-statement
+  // constexpr rules of C++11, which is what the Arduino toolchain uses
+  constexpr double semitoneRatio(const int semitones) {
+    return semitones == 0 ? 1.0 : 1.0594630943592953 * semitoneRatio(semitones - 1);
+  }
+
+  constexpr double octaveRatio(const int octaves) {
+    return octaves == 0 ? 1.0
+      : octaves > 0 ? 2.0 * octaveRatio(octaves - 1)
+      : 0.5 * octaveRatio(octaves + 1);
+  }
+
+  // Note 69 is the reference A; shifting by 51 keeps the division non-negative
+  constexpr double noteAsFreq(const int note) {
+    return REF_A * octaveRatio((note + 51) / 12 - 10) * semitoneRatio((note + 51) % 12);
+  }
+
+  // The oscillator frequency is word * clock / 2^24 Hz
+  constexpr uint16_t clampToWord(const double word) {
+    return word >= 65535.0 ? 0xffff : (uint16_t)(word + 0.5);
+  }
+
+  constexpr uint16_t noteAsWord(const int note, const uint32_t clock) {
+    return clampToWord(noteAsFreq(note) * 16777216.0 / clock);
+  }
+
+  template<uint8_t... Notes>
+  struct NoteList {};
+
+  template<uint8_t N, uint8_t... Notes>
+  struct MakeNoteList : MakeNoteList<N - 1, N - 1, Notes...> {};
+
+  template<uint8_t... Notes>
+  struct MakeNoteList<0, Notes...> {
+    typedef NoteList<Notes...> type;
+  };
+
+  template<uint32_t Clock, typename List = typename MakeNoteList<NUM_NOTES>::type>
+  struct FrequencyTable;
+
+  // Frequency words for all MIDI notes at the given clock, stored in flash on AVR.
+  // Notes too high for the chip at this clock are clamped to the highest word.
+  template<uint32_t Clock, uint8_t... Notes>
+  struct FrequencyTable<Clock, NoteList<Notes...>> {
+    static constexpr uint16_t words[sizeof...(Notes)] MOS8561_PROGMEM = {
+      noteAsWord(Notes, Clock)...
+    };
+  };
+
+  template<uint32_t Clock, uint8_t... Notes>
+  constexpr uint16_t FrequencyTable<Clock, NoteList<Notes...>>::words[sizeof...(Notes)];
+
+  inline uint16_t readWord(const uint16_t* word) {
+#ifdef __AVR__
+    return pgm_read_word(word);
+#else
+    return *word;
+#endif
+  }
+
+  // Frequency word for an 8.8 fixed point pitch, linearly interpolated
+  // between the two neighbouring notes. The error of the interpolation
+  // stays below one cent.
+  template<uint32_t Clock>
+  uint16_t pitchAsWord(int32_t pitch) {
+    const int32_t maxPitch = (int32_t)(NUM_NOTES - 1) * PITCH_STEPS_PER_NOTE;
+    pitch = pitch < 0 ? 0 : pitch > maxPitch ? maxPitch : pitch;
+    const uint8_t note = pitch >> 8;
+    const uint8_t fraction = pitch & 0xff;
+    const uint16_t* words = FrequencyTable<Clock>::words;
+    const uint16_t lower = readWord(&words[note]);
+    if (fraction == 0) {
+      return lower;
+    }
+    const uint16_t upper = readWord(&words[note + 1]);
+    return lower + (uint16_t)(((uint32_t)(upper - lower) * fraction) >> 8);
+  }
+
+  template<typename Note> struct IsFractional { static const bool value = false; };
+  template<> struct IsFractional<float> { static const bool value = true; };
+  template<> struct IsFractional<long double> { static const bool value = true; };
+
+  // Fractional notes are rounded to 1/256 semitone
+  int16_t noteAsPitch(const double note) {
+    return note < 0 ? 0
+      : note >= NUM_NOTES - 1 ? (int16_t)((NUM_NOTES - 1) * PITCH_STEPS_PER_NOTE)
+      : (int16_t)(note * PITCH_STEPS_PER_NOTE + 0.5);
+  }
+
+  // 8.8 fixed point pitch of a note of any arithmetic type, clamped to the
+  // table before narrowing. Integral notes never touch floating point.
+  template<typename Note>
+  int16_t noteAsPitch(const Note note) {
+    return IsFractional<Note>::value ? noteAsPitch((double)note)
+      : note <= 0 ? 0
+      : note >= NUM_NOTES ? (int16_t)((NUM_NOTES - 1) * PITCH_STEPS_PER_NOTE)
+      : (int16_t)((int16_t)note * PITCH_STEPS_PER_NOTE);
+  }
+}; // unnamed namespace
+
+} // namespace sid
+
+#endif
@@ -0,0 +1,268 @@
+/*
+  Scheduler - Timestamped events for Mos8561, queued lock-free between
+  a producer (loop, MIDI, UI thread) and a timer driven consumer (ISR, thread)
+  Released into the public domain
+*/
+
+#ifndef Scheduler_h
+#define Scheduler_h
+
+#include "Mos8561.h"
+
+#include <stdint.h>
+
+#ifndef __AVR__
+#include <atomic>
+#endif
+
+
+namespace sid {
+
+namespace {
+#ifdef __AVR__
+  // Single byte loads and stores are atomic on AVR. The barriers keep the
+  // compiler from moving accesses to the queue's slots across them.
+  class RingIndex {
+  public:
+    uint8_t loadRelaxed() const {
+      return value;
+    }
+
+    uint8_t loadAcquire() const {
+      const uint8_t v = value;
+      __asm__ __volatile__("" ::: "memory");
+      return v;
+    }
+
+    void storeRelease(const uint8_t v) {
+      __asm__ __volatile__("" ::: "memory");
+      value = v;
+    }
+
+  private:
+    volatile uint8_t value = 0;
+  };
+#else
+  class RingIndex {
+  public:
+    uint8_t loadRelaxed() const {
+      return value.load(std::memory_order_relaxed);
+    }
+
+    uint8_t loadAcquire() const {
+      return value.load(std::memory_order_acquire);
+    }
+
+    void storeRelease(const uint8_t v) {
+      value.store(v, std::memory_order_release);
+    }
+
+  private:
+    std::atomic<uint8_t> value{0};
+  };
+#endif
+}; // unnamed namespace
+
+// Fixed capacity queue for exactly one producer and one consumer.
+// Neither side ever blocks or disables interrupts.
+template<typename T, uint8_t Capacity>
+class SpscQueue
+{
+public:
+  static_assert(Capacity > 0 && Capacity <= 128 && (Capacity & (Capacity - 1)) == 0,
+    "Capacity must be a power of two of at most 128");
+
+  // Producer side, returns false if the queue is full
+  bool push(const T& item) {
+    const uint8_t t = tail.loadRelaxed();
+    if ((uint8_t)(t - head.loadAcquire()) == Capacity) {
+      return false;
+    }
+    slots[t & (Capacity - 1)] = item;
+    tail.storeRelease(t + 1);
+    return true;
+  }
+
+  // Consumer side, the oldest item or nullptr if the queue is empty
+  const T* front() const {
+    const uint8_t h = head.loadRelaxed();
+    if (h == tail.loadAcquire()) {
+      return nullptr;
+    }
+    return &slots[h & (Capacity - 1)];
+  }
+
+  // Consumer side, drops the item returned by front()
+  void pop() {
+    head.storeRelease(head.loadRelaxed() + 1);
+  }
+
+private:
+  T slots[Capacity];
+  RingIndex head;
+  RingIndex tail;
+};
+
+enum class EventType : uint8_t {
+  NoteOn,
+  NoteOff,
+  PitchBend,
+  PulseWidth,
+  Waveform,
+  Adsr,
+  Volume,
+  Filter
+};
+
+struct Event {
+  struct Note {
+    uint8_t note;
+    uint8_t velocity;
+  };
+
+  // Time in whatever unit the consumer ticks in, e.g. micros() or millis()
+  uint32_t time;
+  EventType type;
+  uint8_t voiceNum;
+  union {
+    Note note;
+    int16_t bend;
+    uint16_t width;
+    Waveform waveform;
+    Adsr adsr;
+    uint8_t volume;
+    bool isEnabled;
+  };
+
+  static Event noteOn(const uint32_t time, const uint8_t voiceNum, const uint8_t note,
+      const uint8_t velocity) {
+    Event e = make(time, EventType::NoteOn, voiceNum);
+    e.note.note = note;
+    e.note.velocity = velocity;
+    return e;
+  }
+
+  static Event noteOff(const uint32_t time, const uint8_t voiceNum, const uint8_t note) {
+    Event e = make(time, EventType::NoteOff, voiceNum);
+    e.note.note = note;
+    e.note.velocity = 0;
+    return e;
+  }
+
+  static Event pitchBend(const uint32_t time, const uint8_t voiceNum, const int16_t bend) {
+    Event e = make(time, EventType::PitchBend, voiceNum);
+    e.bend = bend;
+    return e;
+  }
+
+  static Event pulseWidth(const uint32_t time, const uint8_t voiceNum, const uint16_t width) {
+    Event e = make(time, EventType::PulseWidth, voiceNum);
+    e.width = width;
+    return e;
+  }
+
+  static Event setWaveform(const uint32_t time, const uint8_t voiceNum, const Waveform waveform) {
+    Event e = make(time, EventType::Waveform, voiceNum);
+    e.waveform = waveform;
+    return e;
+  }
+
+  static Event setAdsr(const uint32_t time, const uint8_t voiceNum, const Adsr adsr) {
+    Event e = make(time, EventType::Adsr, voiceNum);
+    e.adsr = adsr;
+    return e;
+  }
+
+  static Event setVolume(const uint32_t time, const uint8_t volume) {
+    Event e = make(time, EventType::Volume, 0);
+    e.volume = volume;
+    return e;
+  }
+
+  static Event setFilter(const uint32_t time, const uint8_t voiceNum, const bool isEnabled) {
+    Event e = make(time, EventType::Filter, voiceNum);
+    e.isEnabled = isEnabled;
+    return e;
+  }
+
+private:
+  static Event make(const uint32_t time, const EventType type, const uint8_t voiceNum) {
+    Event e;
+    e.time = time;
+    e.type = type;
+    e.voiceNum = voiceNum;
+    return e;
+  }
+};
+
+// Applies an event to a Mos8561 right away, ignoring its time
+template<typename Synth>
+void playEvent(Synth& synth, const Event& event) {
+  switch (event.type) {
+    case EventType::NoteOn:
+    case EventType::NoteOff:
+      synth.playNote(event.voiceNum, (int)event.note.note, event.note.velocity);
+      break;
+    case EventType::PitchBend:
+      synth.setPitchBend(event.voiceNum, event.bend);
+      break;
+    case EventType::PulseWidth:
+      synth.setPulseWidth(event.voiceNum, event.width);
+      break;
+    case EventType::Waveform:
+      synth.setWaveform(event.voiceNum, event.waveform);
+      break;
+    case EventType::Adsr:
+      synth.setAdsr(event.voiceNum, event.adsr);
+      break;
+    case EventType::Volume:
+      synth.setVolume(event.volume);
+      break;
+    case EventType::Filter:
+      synth.setFilterIsEnabled(event.voiceNum, event.isEnabled);
+      break;
+  }
+}
+
+// Plays events on a Mos8561 when they are due. post() is called by the
+// producer, tick() by the consumer, e.g. from a timer interrupt.
+// Events must be posted in the order of their time.
+template<typename Synth, uint8_t Capacity = 32>
+class Scheduler
+{
+public:
+  explicit Scheduler(Synth& s)
+    : synth(s) {
+  }
+
+  // Returns false instead of blocking if the queue is full
+  bool post(const Event& event) {
+    return queue.push(event);
+  }
+
+  // Plays all events due at now and returns how many there were.
+  // The comparison is safe across the wrap around of the clock.
+  uint8_t tick(const uint32_t now) {
+    uint8_t numPlayed = 0;
+    const Event* event = queue.front();
+    while (event && (int32_t)(now - event->time) >= 0) {
+      playEvent(synth, *event);
+      queue.pop();
+      ++numPlayed;
+      event = queue.front();
+    }
+    return numPlayed;
+  }
+
+  bool isIdle() const {
+    return queue.front() == nullptr;
+  }
+
+private:
+  Synth& synth;
+  SpscQueue<Event, Capacity> queue;
+};
+
+} // namespace sid
+
+#endif
@@ -0,0 +1,189 @@
+/*
+  Sequencer - Patterns compiled ahead of time into register writes,
+  so that playback only has to send bytes to the Controller
+  Released into the public domain
+*/
+
+#ifndef Sequencer_h
+#define Sequencer_h
+
+#include "Mos8561.h"
+#include "Scheduler.h"
+
+#include <stdint.h>
+
+
+namespace sid {
+
+// One register write at a tick of the pattern. Programs are arrays of these,
+// sorted by tick, in RAM or declared with MOS8561_PROGMEM.
+struct SequenceOp {
+  uint16_t tick;
+  uint8_t address;
+  uint8_t data;
+};
+
+namespace {
+  SequenceOp readOp(const SequenceOp* op, const bool isInFlash) {
+#ifdef __AVR__
+    if (isInFlash) {
+      SequenceOp o;
+      memcpy_P(&o, op, sizeof(SequenceOp));
+      return o;
+    }
+#else
+    (void)isInFlash;
+#endif
+    return *op;
+  }
+}; // unnamed namespace
+
+// Plays a pattern of events through a Mos8561 that writes into an array of ops
+// instead of a chip. The time of the events is the tick within the pattern.
+// Registers start out unknown, so that the first write of every register in
+// the pattern is kept and the program sounds the same on every loop.
+template<uint32_t Clock = CLOCK_1MHZ>
+class SequenceCompiler
+{
+public:
+  SequenceCompiler(SequenceOp* buffer, const uint16_t capacity)
+    : ops(buffer)
+    , maxOps(capacity) {
+  }
+
+  // Events must be sorted by time. Returns false if the buffer is too small.
+  bool compile(const Event* events, const uint16_t numEvents) {
+    numOps = 0;
+    hasOverflowed = false;
+    Mos8561<Recorder, Clock> synth(Recorder{this});
+    for (uint16_t i = 0; i < numEvents; ++i) {
+      assert(i == 0 || events[i].time >= events[i - 1].time);
+      assert(events[i].time <= 0xffff);
+      tick = (uint16_t)events[i].time;
+      playEvent(synth, events[i]);
+    }
+    return !hasOverflowed;
+  }
+
+  uint16_t size() const {
+    return numOps;
+  }
+
+private:
+  struct Recorder {
+    void startClock() {}
+
+    void reset() {}
+
+    void writeRegister(const uint8_t address, const uint8_t data) {
+      compiler->append(address, data);
+    }
+
+    SequenceCompiler* compiler;
+  };
+
+  void append(const uint8_t address, const uint8_t data) {
+    if (numOps == maxOps) {
+      hasOverflowed = true;
+      return;
+    }
+    ops[numOps].tick = tick;
+    ops[numOps].address = address;
+    ops[numOps].data = data;
+    ++numOps;
+  }
+
+  SequenceOp* ops;
+  const uint16_t maxOps;
+  uint16_t numOps = 0;
+  uint16_t tick = 0;
+  bool hasOverflowed = false;
+};
+
+// Sends a compiled program to a Controller. Call poll() often enough, e.g.
+// from a timer interrupt, its cost per tick only depends on the number of
+// ops in that tick. The tick interval is in the unit of now, e.g. micros(),
+// and can be changed while playing. When poll() runs in an interrupt, call
+// the setters with interrupts off, on AVR a uint32_t is not written at once.
+// Playback bypasses the Mos8561 the Controller belongs to, call its
+// invalidate() before using it again.
+template<typename Controller>
+class SequencePlayer
+{
+public:
+  explicit SequencePlayer(Controller& ctr)
+    : controller(ctr) {
+  }
+
+  // length is the number of ticks after which the program ends or loops
+  void setProgram(const SequenceOp* program, const uint16_t count, const uint16_t length,
+      const bool isInFlash = false) {
+    ops = program;
+    numOps = count;
+    numTicks = length;
+    isProgramInFlash = isInFlash;
+    isPlaying = false;
+  }
+
+  void setTickInterval(const uint32_t interval) {
+    tickInterval = interval;
+  }
+
+  void setIsLooping(const bool isOn) {
+    isLooping = isOn;
+  }
+
+  void start(const uint32_t now) {
+    tick = 0;
+    position = 0;
+    nextTickTime = now;
+    isPlaying = numTicks > 0;
+  }
+
+  void stop() {
+    isPlaying = false;
+  }
+
+  // Plays all ticks due at now, returns false once the program is done
+  bool poll(const uint32_t now) {
+    while (isPlaying && (int32_t)(now - nextTickTime) >= 0) {
+      playTick();
+      nextTickTime += tickInterval;
+    }
+    return isPlaying;
+  }
+
+private:
+  void playTick() {
+    while (position < numOps) {
+      const SequenceOp op = readOp(ops + position, isProgramInFlash);
+      if (op.tick != tick) {
+        break;
+      }
+      controller.writeRegister(op.address, op.data);
+      ++position;
+    }
+    if (++tick < numTicks) {
+      return;
+    }
+    tick = 0;
+    position = 0;
+    isPlaying = isLooping;
+  }
+
+  Controller& controller;
+  const SequenceOp* ops = nullptr;
+  uint16_t numOps = 0;
+  uint16_t numTicks = 0;
+  bool isProgramInFlash = false;
+  uint32_t tickInterval = 1;
+  bool isLooping = false;
+  bool isPlaying = false;
+  uint16_t tick = 0;
+  uint16_t position = 0;
+  uint32_t nextTickTime = 0;
+};
+
+} // namespace sid
+
+#endif
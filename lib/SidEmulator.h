@@ -0,0 +1,629 @@
+/*
+  SidEmulator - Software model of the Mos8561 Chip that renders PCM audio
+  Meant for running Mos8561 on a host without a chip attached
+  Released into the public domain
+*/
+
+#ifndef SidEmulator_h
+#define SidEmulator_h
+
+#include "Mos8561.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+
+namespace sid {
+
+namespace {
+  // Attack times in seconds for a full 0 - 255 sweep, decay and release
+  // use the same rates but take three times as long due to the exponential curve
+  const float ATTACK_TIMES[16] = {
+    0.002f, 0.008f, 0.016f, 0.024f, 0.038f, 0.056f, 0.068f, 0.080f,
+    0.100f, 0.250f, 0.500f, 0.800f, 1.0f, 3.0f, 5.0f, 8.0f
+  };
+
+  const uint8_t CONTROL_GATE = 0x01;
+
+  const uint8_t FILTER_LP = 0x10;
+  const uint8_t FILTER_BP = 0x20;
+  const uint8_t FILTER_HP = 0x40;
+  const uint8_t VOICE3_OFF = 0x80;
+
+  const uint32_t NOISE_SEED = 0x7ffff8;
+
+  const size_t MAX_DECIMATION_TAPS = 1024;
+
+  struct Decimation {
+    uint8_t oversampling;
+    uint16_t numTaps;
+    // Stopband attenuation in dB
+    uint8_t attenuation;
+  };
+
+  // Indexed by RenderQuality
+  const Decimation DECIMATIONS[4] = {
+    {1, 0, 0},
+    {4, 128, 60},
+    {4, 256, 75},
+    {8, 1024, 96}
+  };
+}; // unnamed namespace
+
+// Trades speed for aliasing. PointSampled runs the chip at the output rate,
+// aliases and all. The others smooth the edges of the saw, pulse and triangle
+// waves, run the chip at 4 times the output rate (Best at 8 times) and
+// decimate with a filter whose stopband starts at the output's Nyquist
+// frequency. Fast uses 128 taps at 60 dB, Good 256 taps at 75 dB and Best
+// 1024 taps at 96 dB. Longer filters also keep more of the top of the audio
+// band, at 44.1 kHz it reaches about 17, 19 and 20 kHz.
+enum class RenderQuality : uint8_t {
+  PointSampled,
+  Fast,
+  Good,
+  Best
+};
+
+// Renders the audio the chip would produce for the registers written to it.
+// Oscillators run as 24.8 fixed point accumulators, so that the 24 bit phase
+// of the chip sits in the upper bits and wraps on its own.
+class Emulator
+{
+public:
+  static const size_t BLOCK_SIZE = 64;
+
+  explicit Emulator(const uint32_t rate = 44100, const uint32_t clk = CLOCK_1MHZ,
+      const RenderQuality quality = RenderQuality::Good)
+    : sampleRate(rate)
+    , clock(clk)
+    , oversampling(DECIMATIONS[uint8_t(quality)].oversampling)
+    , numTaps(DECIMATIONS[uint8_t(quality)].numTaps)
+    , coreRate(rate * oversampling) {
+    makeDecimationFilter(DECIMATIONS[uint8_t(quality)].attenuation);
+    reset();
+  }
+
+  void startClock() {
+    isClocked = true;
+  }
+
+  void reset() {
+    memset(registers, 0, sizeof(registers));
+    for (uint8_t v = 0; v < 3; ++v) {
+      oscillators[v] = Oscillator();
+      envelopes[v] = Envelope();
+      updateEnvelope(v);
+    }
+    filterLow = 0.f;
+    filterBand = 0.f;
+    updateFilter();
+    memset(history, 0, sizeof(history));
+  }
+
+  void writeRegister(const uint8_t address, const uint8_t data) {
+    // The paddles, OSC3 and ENV3 can only be read
+    if (address >= POT_X) {
+      return;
+    }
+    const uint8_t previous = registers[address];
+    registers[address] = data;
+    if (address < 21) {
+      const uint8_t voiceNum = address / 7;
+      switch (address % 7) {
+        case 0:
+        case 1:
+          updateStep(voiceNum);
+          break;
+        case 4:
+          updateGate(voiceNum, previous, data);
+          break;
+        case 5:
+        case 6:
+          updateEnvelope(voiceNum);
+          break;
+      }
+    } else if (address < 24) {
+      updateFilter();
+    }
+  }
+
+  // OSC3 and ENV3 hold the state of voice 3 at the end of the last rendered block
+  uint8_t registerValue(const uint8_t address) const {
+    return registers[address];
+  }
+
+  // Renders frames of mono audio in the range -1 to 1.
+  // The cost per frame does not depend on the size of the buffer.
+  void render(float* out, size_t frames) {
+    if (oversampling == 1) {
+      while (frames > 0) {
+        const size_t n = frames < BLOCK_SIZE ? frames : BLOCK_SIZE;
+        renderBlock(out, n);
+        out += n;
+        frames -= n;
+      }
+      return;
+    }
+    const size_t framesPerBlock = BLOCK_SIZE / oversampling;
+    while (frames > 0) {
+      const size_t n = frames < framesPerBlock ? frames : framesPerBlock;
+      renderDecimated(out, n);
+      out += n;
+      frames -= n;
+    }
+  }
+
+  void render(int16_t* out, size_t frames) {
+    float block[BLOCK_SIZE];
+    while (frames > 0) {
+      const size_t n = frames < BLOCK_SIZE ? frames : BLOCK_SIZE;
+      render(block, n);
+      for (size_t i = 0; i < n; ++i) {
+        const float s = block[i] > 1.f ? 1.f : block[i] < -1.f ? -1.f : block[i];
+        out[i] = (int16_t)(s * 32767.f);
+      }
+      out += n;
+      frames -= n;
+    }
+  }
+
+private:
+  enum class EnvelopeState : uint8_t {
+    Attack,
+    DecaySustain,
+    Release
+  };
+
+  struct Oscillator {
+    uint32_t acc = 0;
+    uint32_t step = 0;
+    uint32_t noise = NOISE_SEED;
+  };
+
+  struct Envelope {
+    EnvelopeState state = EnvelopeState::Release;
+    float level = 0.f;
+    float attackStep = 0.f;
+    float decayStep = 0.f;
+    float releaseStep = 0.f;
+    float sustain = 0.f;
+  };
+
+  void updateStep(const uint8_t voiceNum) {
+    const uint64_t freq = registers[voiceNum * 7] | (registers[voiceNum * 7 + 1] << 8);
+    oscillators[voiceNum].step = (uint32_t)((freq * clock * 256) / coreRate);
+  }
+
+  void updateGate(const uint8_t voiceNum, const uint8_t previous, const uint8_t control) {
+    if (!(previous & CONTROL_GATE) && (control & CONTROL_GATE)) {
+      envelopes[voiceNum].state = EnvelopeState::Attack;
+    } else if ((previous & CONTROL_GATE) && !(control & CONTROL_GATE)) {
+      envelopes[voiceNum].state = EnvelopeState::Release;
+    }
+  }
+
+  void updateEnvelope(const uint8_t voiceNum) {
+    Envelope& env = envelopes[voiceNum];
+    const uint8_t attackDecay = registers[voiceNum * 7 + 5];
+    const uint8_t sustainRelease = registers[voiceNum * 7 + 6];
+    env.attackStep = stepForRate(attackDecay >> 4);
+    env.decayStep = stepForRate(attackDecay & 0xf);
+    env.sustain = (sustainRelease >> 4) / 15.f;
+    env.releaseStep = stepForRate(sustainRelease & 0xf);
+  }
+
+  float stepForRate(const uint8_t rate) const {
+    return 1.f / (ATTACK_TIMES[rate] * coreRate);
+  }
+
+  // Zero delay feedback state variable filter, stable for all cutoffs
+  void updateFilter() {
+    const uint16_t fc = (registers[0x16] << 3) | (registers[0x15] & 0x7);
+    float cutoff = 30.f + fc * (12000.f / 2047.f);
+    const float maxCutoff = 0.45f * coreRate;
+    cutoff = cutoff > maxCutoff ? maxCutoff : cutoff;
+    const float q = 0.707f + (registers[0x17] >> 4) * (3.3f / 15.f);
+    const float g = tanf(3.14159265f * cutoff / coreRate);
+    filterDamping = 1.f / q;
+    filterA1 = 1.f / (1.f + g * (g + filterDamping));
+    filterA2 = g * filterA1;
+    filterA3 = g * filterA2;
+  }
+
+  // Kaiser windowed sinc with a gain of 1, computed once as it only depends
+  // on the quality. The transition band ends at the output's Nyquist
+  // frequency and is as narrow as the taps allow for the attenuation.
+  void makeDecimationFilter(const double attenuation) {
+    const double pi = 3.14159265358979;
+    // Kaiser's estimate of the transition width, in cycles per core sample
+    const double transition = (attenuation - 7.95) / (14.36 * numTaps);
+    const double cutoff = 0.5 / oversampling - transition / 2.0;
+    const double beta = 0.1102 * (attenuation - 8.7);
+    const double center = (numTaps - 1) / 2.0;
+    double sum = 0.0;
+    for (size_t i = 0; i < numTaps; ++i) {
+      const double x = i - center;
+      const double sinc = 2.0 * cutoff * (x == 0.0 ? 1.0 : sin(2.0 * pi * cutoff * x) / (2.0 * pi * cutoff * x));
+      const double r = x / center;
+      const double window = besselI0(beta * sqrt(1.0 - r * r)) / besselI0(beta);
+      coefficients[i] = (float)(sinc * window);
+      sum += coefficients[i];
+    }
+    for (size_t i = 0; i < numTaps; ++i) {
+      coefficients[i] = (float)(coefficients[i] / sum);
+    }
+  }
+
+  // Modified Bessel function of the first kind and order 0, by its series
+  static double besselI0(const double x) {
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; term > 1e-12 * sum; ++k) {
+      const double f = x / (2.0 * k);
+      term *= f * f;
+      sum += term;
+    }
+    return sum;
+  }
+
+  // Renders n * oversampling samples at the core rate behind the last
+  // numTaps - 1 of the previous block, then evaluates the filter only at
+  // every oversampling-th of them, which is all a polyphase decimator does
+  void renderDecimated(float* out, const size_t n) {
+    const size_t numCore = n * oversampling;
+    renderBlock(history + numTaps - 1, numCore);
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = dot(history + i * oversampling + oversampling - 1);
+    }
+    memmove(history, history + numCore, (numTaps - 1) * sizeof(float));
+  }
+
+  // Coefficients are symmetric, so the window may run either way.
+  // numTaps is a multiple of 4, the coefficients are aligned to 16 bytes.
+  float dot(const float* window) const {
+#ifdef __SSE__
+    __m128 sum = _mm_setzero_ps();
+    for (size_t i = 0; i < numTaps; i += 4) {
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(window + i), _mm_load_ps(coefficients + i)));
+    }
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+#else
+    float sums[4] = {0.f, 0.f, 0.f, 0.f};
+    for (size_t i = 0; i < numTaps; i += 4) {
+      for (size_t j = 0; j < 4; ++j) {
+        sums[j] += window[i + j] * coefficients[i + j];
+      }
+    }
+    return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+#endif
+  }
+
+  void renderBlock(float* out, const size_t n) {
+    if (!isClocked) {
+      memset(out, 0, n * sizeof(float));
+      return;
+    }
+    for (uint8_t v = 0; v < 3; ++v) {
+      if (!(control(v) & CONTROL_SYNC)) {
+        runOscillator(v, n);
+      }
+    }
+    // Hard sync depends on the accumulator of the source voice
+    for (uint8_t v = 0; v < 3; ++v) {
+      if (control(v) & CONTROL_SYNC) {
+        runSyncedOscillator(v, n);
+      }
+    }
+    float filterIn[BLOCK_SIZE];
+    float direct[BLOCK_SIZE];
+    for (size_t i = 0; i < n; ++i) {
+      filterIn[i] = 0.f;
+      direct[i] = 0.f;
+    }
+    const uint8_t routing = registers[0x17];
+    const uint8_t modeVol = registers[0x18];
+    for (uint8_t v = 0; v < 3; ++v) {
+      runWaveform(v, n);
+      runEnvelope(v, n);
+      const bool isFiltered = routing & (1 << v);
+      const bool isMuted = v == 2 && !isFiltered && (modeVol & VOICE3_OFF);
+      const float filterGain = isFiltered ? 1.f : 0.f;
+      const float directGain = isFiltered || isMuted ? 0.f : 1.f;
+      const float* w = waves[v];
+      const float* e = levels[v];
+      for (size_t i = 0; i < n; ++i) {
+        const float s = w[i] * e[i];
+        filterIn[i] += s * filterGain;
+        direct[i] += s * directGain;
+      }
+    }
+    const float lpGain = modeVol & FILTER_LP ? 1.f : 0.f;
+    const float bpGain = modeVol & FILTER_BP ? 1.f : 0.f;
+    const float hpGain = modeVol & FILTER_HP ? 1.f : 0.f;
+    const float volume = (modeVol & 0xf) / (15.f * 3.f);
+    float low = filterLow;
+    float band = filterBand;
+    for (size_t i = 0; i < n; ++i) {
+      const float x = filterIn[i];
+      const float v3 = x - low;
+      const float v1 = filterA1 * band + filterA2 * v3;
+      const float v2 = low + filterA2 * band + filterA3 * v3;
+      band = 2.f * v1 - band;
+      low = 2.f * v2 - low;
+      const float hp = x - filterDamping * v1 - v2;
+      const float filtered = lpGain * v2 + bpGain * v1 + hpGain * hp;
+      out[i] = (direct[i] + filtered) * volume;
+    }
+    filterLow = low;
+    filterBand = band;
+    registers[OSC3] = (uint8_t)((waves[2][n - 1] * 2048.f + 2048.f) * (1.f / 16.f));
+    registers[ENV3] = (uint8_t)(levels[2][n - 1] * 255.f);
+  }
+
+  uint8_t control(const uint8_t voiceNum) const {
+    return registers[voiceNum * 7 + 4];
+  }
+
+  static uint8_t sourceOf(const uint8_t voiceNum) {
+    return voiceNum == 0 ? 2 : voiceNum - 1;
+  }
+
+  void runOscillator(const uint8_t voiceNum, const size_t n) {
+    Oscillator& osc = oscillators[voiceNum];
+    uint32_t* acc = accumulators[voiceNum];
+    blockStart[voiceNum] = osc.acc;
+    // The test bit holds the oscillator at zero
+    const uint32_t start = control(voiceNum) & CONTROL_TEST ? 0 : osc.acc;
+    const uint32_t step = control(voiceNum) & CONTROL_TEST ? 0 : osc.step;
+    for (size_t i = 0; i < n; ++i) {
+      acc[i] = start + step * (uint32_t)(i + 1);
+    }
+    osc.acc = acc[n - 1];
+  }
+
+  void runSyncedOscillator(const uint8_t voiceNum, const size_t n) {
+    Oscillator& osc = oscillators[voiceNum];
+    uint32_t* acc = accumulators[voiceNum];
+    const uint32_t* source = accumulators[sourceOf(voiceNum)];
+    blockStart[voiceNum] = osc.acc;
+    const bool isTest = control(voiceNum) & CONTROL_TEST;
+    uint32_t a = osc.acc;
+    uint32_t previous = blockStart[sourceOf(voiceNum)];
+    for (size_t i = 0; i < n; ++i) {
+      a = isTest ? 0 : a + osc.step;
+      if (!(previous & 0x80000000) && (source[i] & 0x80000000)) {
+        a = 0;
+      }
+      previous = source[i];
+      acc[i] = a;
+    }
+    osc.acc = a;
+  }
+
+  // Clocks the noise generator whenever bit 19 of the phase rises
+  void runNoise(const uint8_t voiceNum, const size_t n, uint32_t* noise) {
+    Oscillator& osc = oscillators[voiceNum];
+    const uint32_t* acc = accumulators[voiceNum];
+    uint32_t previous = blockStart[voiceNum];
+    uint32_t lfsr = osc.noise;
+    for (size_t i = 0; i < n; ++i) {
+      const uint32_t clocks = ((acc[i] >> 28) - (previous >> 28)) & 0xf;
+      for (uint32_t c = 0; c < clocks; ++c) {
+        const uint32_t bit = ((lfsr >> 22) ^ (lfsr >> 17)) & 1;
+        lfsr = ((lfsr << 1) | bit) & 0x7fffff;
+      }
+      previous = acc[i];
+      noise[i] = ((lfsr >> 11) & 0x800) | ((lfsr >> 10) & 0x400) | ((lfsr >> 7) & 0x200)
+        | ((lfsr >> 5) & 0x100) | ((lfsr >> 4) & 0x080) | ((lfsr >> 1) & 0x040)
+        | ((lfsr << 1) & 0x020) | ((lfsr << 2) & 0x010);
+    }
+    osc.noise = lfsr;
+  }
+
+  // Combined waveforms are approximated by and-ing the selected ones.
+  // The loop is kept free of branches so that it vectorises.
+  void runWaveform(const uint8_t voiceNum, const size_t n) {
+    const uint8_t ctl = control(voiceNum);
+    float* wave = waves[voiceNum];
+    if (!(ctl & 0xf0)) {
+      for (size_t i = 0; i < n; ++i) {
+        wave[i] = 0.f;
+      }
+      return;
+    }
+    // Hard sync and ring modulation move the edges to where the other
+    // voice puts them, those waves are left as they are
+    const uint8_t waveform = ctl & 0xf0;
+    const bool hasKnownEdges = waveform == uint8_t(Waveform::Saw)
+      || waveform == uint8_t(Waveform::Square)
+      || (waveform == uint8_t(Waveform::Triangle) && !(ctl & CONTROL_RING_MOD));
+    if (oversampling > 1 && hasKnownEdges && !(ctl & CONTROL_SYNC)) {
+      runBandLimitedWaveform(voiceNum, n);
+      return;
+    }
+    uint32_t noise[BLOCK_SIZE];
+    if (ctl & uint8_t(Waveform::Noise)) {
+      runNoise(voiceNum, n, noise);
+    } else {
+      for (size_t i = 0; i < n; ++i) {
+        noise[i] = 0xfff;
+      }
+    }
+    const uint32_t* acc = accumulators[voiceNum];
+    const uint32_t* source = accumulators[sourceOf(voiceNum)];
+    const uint32_t ringMask = ctl & CONTROL_RING_MOD ? 0x80000000 : 0;
+    const uint32_t sawOff = ctl & uint8_t(Waveform::Saw) ? 0 : 0xfff;
+    const uint32_t triOff = ctl & uint8_t(Waveform::Triangle) ? 0 : 0xfff;
+    const uint32_t pulseOff = ctl & uint8_t(Waveform::Square) ? 0 : 0xfff;
+    const uint32_t width = registers[voiceNum * 7 + 2] | ((registers[voiceNum * 7 + 3] & 0xf) << 8);
+    for (size_t i = 0; i < n; ++i) {
+      const uint32_t a = acc[i];
+      const uint32_t saw = a >> 20;
+      const uint32_t msb = (a ^ (source[i] & ringMask)) >> 31;
+      const uint32_t tri = ((a >> 19) ^ (0u - msb)) & 0xfff;
+      const uint32_t pulse = (0u - (uint32_t)(saw >= width)) & 0xfff;
+      const uint32_t w = (saw | sawOff) & (tri | triOff) & (pulse | pulseOff) & noise[i];
+      wave[i] = ((float)w - 2048.f) * (1.f / 2048.f);
+    }
+  }
+
+  // Saw, pulse and triangle with each corner smoothed over a core sample on
+  // either side by a polynomial residual (polyBLEP for steps, polyBLAMP for
+  // the triangle's kinks). Most of what would fold back at the core rate is
+  // gone before the decimation filter sees it.
+  void runBandLimitedWaveform(const uint8_t voiceNum, const size_t n) {
+    const uint8_t ctl = control(voiceNum);
+    const uint32_t* acc = accumulators[voiceNum];
+    float* wave = waves[voiceNum];
+    const float phaseScale = 1.f / 4294967296.f;
+    // Phase advance per core sample
+    const float dt = (ctl & CONTROL_TEST ? 0 : oscillators[voiceNum].step) * phaseScale;
+    const uint32_t width = registers[voiceNum * 7 + 2] | ((registers[voiceNum * 7 + 3] & 0xf) << 8);
+    const uint32_t widthPhase = width << 20;
+    for (size_t i = 0; i < n; ++i) {
+      const uint32_t a = acc[i];
+      const uint32_t saw = a >> 20;
+      const float t = a * phaseScale;
+      if (ctl & uint8_t(Waveform::Saw)) {
+        wave[i] = ((float)saw - 2048.f) * (1.f / 2048.f) - polyBlep(t, dt);
+      } else if (ctl & uint8_t(Waveform::Square)) {
+        // Rises where the saw reaches the width, falls where the phase wraps
+        wave[i] = (saw >= width ? 4095.f - 2048.f : -2048.f) * (1.f / 2048.f)
+          + polyBlep((a - widthPhase) * phaseScale, dt) - polyBlep(t, dt);
+      } else {
+        // The slope turns by 8 per cycle at the bottom and by -8 at the top
+        const uint32_t tri = ((a >> 19) ^ (0u - (a >> 31))) & 0xfff;
+        wave[i] = ((float)tri - 2048.f) * (1.f / 2048.f)
+          + 8.f * dt * (polyBlamp(t, dt) - polyBlamp((a + 0x80000000u) * phaseScale, dt));
+      }
+    }
+  }
+
+  // Residual of a band-limited step of 2 at phase 0, t and dt are in cycles
+  static float polyBlep(const float t, const float dt) {
+    if (t < dt) {
+      const float x = t / dt;
+      return x + x - x * x - 1.f;
+    }
+    if (t > 1.f - dt) {
+      const float x = (t - 1.f) / dt;
+      return x * x + x + x + 1.f;
+    }
+    return 0.f;
+  }
+
+  // Residual of a band-limited kink of 1 per core sample at phase 0
+  static float polyBlamp(const float t, const float dt) {
+    if (t < dt) {
+      const float x = 1.f - t / dt;
+      return x * x * x * (1.f / 6.f);
+    }
+    if (t > 1.f - dt) {
+      const float x = (t - 1.f) / dt + 1.f;
+      return x * x * x * (1.f / 6.f);
+    }
+    return 0.f;
+  }
+
+  // Decay and release slow down at lower levels like the chip's
+  // exponential approximation does
+  static float decayScale(const float level) {
+    return level >= 93.f / 255.f ? 1.f
+      : level >= 54.f / 255.f ? 1.f / 2.f
+      : level >= 26.f / 255.f ? 1.f / 4.f
+      : level >= 14.f / 255.f ? 1.f / 8.f
+      : level >= 6.f / 255.f ? 1.f / 16.f
+      : 1.f / 30.f;
+  }
+
+  void runEnvelope(const uint8_t voiceNum, const size_t n) {
+    Envelope& env = envelopes[voiceNum];
+    float* level = levels[voiceNum];
+    float l = env.level;
+    for (size_t i = 0; i < n; ++i) {
+      switch (env.state) {
+        case EnvelopeState::Attack:
+          l += env.attackStep;
+          if (l >= 1.f) {
+            l = 1.f;
+            env.state = EnvelopeState::DecaySustain;
+          }
+          break;
+        case EnvelopeState::DecaySustain:
+          if (l > env.sustain) {
+            l -= env.decayStep * decayScale(l);
+            l = l < env.sustain ? env.sustain : l;
+          }
+          break;
+        case EnvelopeState::Release:
+          l -= env.releaseStep * decayScale(l);
+          l = l < 0.f ? 0.f : l;
+          break;
+      }
+      level[i] = l;
+    }
+    env.level = l;
+  }
+
+  const uint32_t sampleRate;
+  const uint32_t clock;
+  const uint8_t oversampling;
+  const size_t numTaps;
+  // Rate the chip is modelled at before decimation
+  const uint32_t coreRate;
+  alignas(16) float coefficients[MAX_DECIMATION_TAPS];
+  // Tail of the previous block followed by the current one, at the core rate
+  float history[MAX_DECIMATION_TAPS - 1 + BLOCK_SIZE];
+  bool isClocked = false;
+  uint8_t registers[NUM_REGISTERS];
+  Oscillator oscillators[3];
+  Envelope envelopes[3];
+  float filterLow;
+  float filterBand;
+  float filterDamping;
+  float filterA1;
+  float filterA2;
+  float filterA3;
+  // Per block scratch buffers
+  uint32_t blockStart[3];
+  uint32_t accumulators[3][BLOCK_SIZE];
+  float waves[3][BLOCK_SIZE];
+  float levels[3][BLOCK_SIZE];
+};
+
+// Controller that drives an Emulator instead of a chip
+struct EmulatedController {
+  explicit EmulatedController(Emulator& emu)
+    : emulator(emu) {
+  }
+
+  void startClock() {
+    emulator.startClock();
+  }
+
+  void reset() {
+    emulator.reset();
+  }
+
+  void writeRegister(const uint8_t address, const uint8_t data) {
+    emulator.writeRegister(address, data);
+  }
+
+  uint8_t readRegister(const uint8_t address) {
+    return emulator.registerValue(address);
+  }
+
+  Emulator& emulator;
+};
+
+} // namespace sid
+
+#endif
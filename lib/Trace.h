@@ -0,0 +1,368 @@
+/*
+  Trace - Records timestamped register writes in a compact binary format
+  and replays them into any Controller, from RAM, flash or a mapped file
+  Released into the public domain
+
+  Format, all multi-byte values little endian:
+    header  'S' 'I' 'D' 'T', version (1 byte), ticks per second (4 bytes)
+    record  tag (1 byte) [delta varint] [data (1 byte)]
+
+  The low 5 bits of the tag are the register address, or one of the codes for
+  startClock() and reset(), which carry no data byte. The high 3 bits are the
+  number of ticks since the previous record. If they are all set, the delta
+  minus 7 follows as a varint of 7 bits per byte, least significant first.
+  A write in the same tick as the one before it takes 2 bytes.
+*/
+
+#ifndef Trace_h
+#define Trace_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#endif
+
+#if !defined(__AVR__) && defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+namespace sid {
+
+const uint8_t TRACE_VERSION = 1;
+const uint8_t TRACE_HEADER_SIZE = 9;
+
+const uint8_t TRACE_START_CLOCK = 0x1e;
+const uint8_t TRACE_RESET = 0x1f;
+
+namespace {
+  const uint8_t TRACE_ADDRESS_MASK = 0x1f;
+  const uint8_t TRACE_DELTA_SHIFT = 5;
+  const uint8_t TRACE_DELTA_INLINE = 7;
+}; // unnamed namespace
+
+struct TraceRecord {
+  // Ticks since the first record
+  uint32_t time;
+  // Register address, TRACE_START_CLOCK or TRACE_RESET
+  uint8_t code;
+  uint8_t data;
+};
+
+// Encodes records into a Sink, which needs a method put(uint8_t).
+// Clock needs a method now() and a constant TICKS_PER_SECOND (see Clocks.h).
+template<typename Sink, typename Clock>
+class TraceWriter
+{
+public:
+  TraceWriter(Sink& s, Clock c)
+    : sink(s)
+    , clock(c) {
+    sink.put('S');
+    sink.put('I');
+    sink.put('D');
+    sink.put('T');
+    sink.put(TRACE_VERSION);
+    const uint32_t rate = Clock::TICKS_PER_SECOND;
+    for (uint8_t i = 0; i < 4; ++i) {
+      sink.put((uint8_t)(rate >> (8 * i)));
+    }
+  }
+
+  void record(const uint8_t code, const uint8_t data) {
+    const uint32_t now = clock.now();
+    const uint32_t delta = hasRecords ? now - lastTime : 0;
+    hasRecords = true;
+    lastTime = now;
+    if (delta < TRACE_DELTA_INLINE) {
+      sink.put((uint8_t)(delta << TRACE_DELTA_SHIFT | code));
+    } else {
+      sink.put((uint8_t)(TRACE_DELTA_INLINE << TRACE_DELTA_SHIFT | code));
+      uint32_t rest = delta - TRACE_DELTA_INLINE;
+      while (rest >= 0x80) {
+        sink.put((uint8_t)(rest | 0x80));
+        rest >>= 7;
+      }
+      sink.put((uint8_t)rest);
+    }
+    if (code < TRACE_START_CLOCK) {
+      sink.put(data);
+    }
+  }
+
+private:
+  Sink& sink;
+  Clock clock;
+  uint32_t lastTime = 0;
+  bool hasRecords = false;
+};
+
+// Sink into a fixed buffer, drops what does not fit
+template<size_t Size>
+struct TraceBuffer {
+  void put(const uint8_t byte) {
+    if (size < Size) {
+      bytes[size++] = byte;
+    } else {
+      hasOverflowed = true;
+    }
+  }
+
+  uint8_t bytes[Size];
+  size_t size = 0;
+  bool hasOverflowed = false;
+};
+
+// Controller decorator that records every call before forwarding it to Inner
+template<typename Inner, typename Writer>
+class RecordingController
+{
+public:
+  RecordingController(Inner ctr, Writer& w)
+    : inner(ctr)
+    , writer(w) {
+  }
+
+  void startClock() {
+    writer.record(TRACE_START_CLOCK, 0);
+    inner.startClock();
+  }
+
+  void reset() {
+    writer.record(TRACE_RESET, 0);
+    inner.reset();
+  }
+
+  void writeRegister(const uint8_t address, const uint8_t data) {
+    writer.record(address, data);
+    inner.writeRegister(address, data);
+  }
+
+  // Bursts stay bursts if Inner supports them
+  void writeRegisters(const uint8_t* addresses, const uint8_t* data, const uint8_t count) {
+    for (uint8_t i = 0; i < count; ++i) {
+      writer.record(addresses[i], data[i]);
+    }
+    forwardRegisters(inner, addresses, data, count, 0);
+  }
+
+private:
+  template<typename C>
+  static auto forwardRegisters(C& ctr, const uint8_t* addresses, const uint8_t* data,
+      const uint8_t count, int)
+    -> decltype(ctr.writeRegisters(addresses, data, count), void()) {
+    ctr.writeRegisters(addresses, data, count);
+  }
+
+  template<typename C>
+  static void forwardRegisters(C& ctr, const uint8_t* addresses, const uint8_t* data,
+      const uint8_t count, long) {
+    for (uint8_t i = 0; i < count; ++i) {
+      ctr.writeRegister(addresses[i], data[i]);
+    }
+  }
+
+  Inner inner;
+  Writer& writer;
+};
+
+// Byte sources for TraceReader
+struct MemoryBytes {
+  uint8_t operator[](const size_t i) const {
+    return bytes[i];
+  }
+
+  const uint8_t* bytes;
+  size_t size;
+};
+
+// A trace stored with MOS8561_PROGMEM (see NoteTable.h)
+struct FlashBytes {
+  uint8_t operator[](const size_t i) const {
+#ifdef __AVR__
+    return pgm_read_byte(bytes + i);
+#else
+    return bytes[i];
+#endif
+  }
+
+  const uint8_t* bytes;
+  size_t size;
+};
+
+template<typename Bytes>
+class TraceReader
+{
+public:
+  explicit TraceReader(Bytes b)
+    : bytes(b) {
+  }
+
+  // A header with a tick rate of 0 is corrupt, its times cannot be converted
+  bool isValid() const {
+    return bytes.size >= TRACE_HEADER_SIZE && bytes[0] == 'S' && bytes[1] == 'I'
+      && bytes[2] == 'D' && bytes[3] == 'T' && bytes[4] == TRACE_VERSION
+      && ticksPerSecond() > 0;
+  }
+
+  uint32_t ticksPerSecond() const {
+    uint32_t rate = 0;
+    for (uint8_t i = 0; i < 4; ++i) {
+      rate |= (uint32_t)bytes[5 + i] << (8 * i);
+    }
+    return rate;
+  }
+
+  // Reads the next record, returns false at the end or on a truncated record
+  bool next(TraceRecord& record) {
+    if (position >= bytes.size) {
+      return false;
+    }
+    const uint8_t tag = bytes[position++];
+    uint32_t delta = tag >> TRACE_DELTA_SHIFT;
+    if (delta == TRACE_DELTA_INLINE) {
+      uint32_t rest = 0;
+      uint8_t shift = 0;
+      uint8_t byte;
+      do {
+        if (position >= bytes.size || shift > 28) {
+          return false;
+        }
+        byte = bytes[position++];
+        rest |= (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+      } while (byte & 0x80);
+      delta += rest;
+    }
+    record.code = tag & TRACE_ADDRESS_MASK;
+    record.data = 0;
+    if (record.code < TRACE_START_CLOCK) {
+      if (position >= bytes.size) {
+        return false;
+      }
+      record.data = bytes[position++];
+    }
+    time += delta;
+    record.time = time;
+    return true;
+  }
+
+  void rewind() {
+    position = TRACE_HEADER_SIZE;
+    time = 0;
+  }
+
+private:
+  Bytes bytes;
+  size_t position = TRACE_HEADER_SIZE;
+  uint32_t time = 0;
+};
+
+// Plays a trace into a Controller with the timing it was recorded with.
+// Call start() with the current time, then poll() as often as the
+// required precision demands, e.g. from loop() or a timer interrupt.
+// Times are in the ticks of the trace.
+template<typename Controller, typename Bytes>
+class TraceReplayer
+{
+public:
+  TraceReplayer(Controller& ctr, Bytes b)
+    : controller(ctr)
+    , reader(b) {
+  }
+
+  void start(const uint32_t now) {
+    reader.rewind();
+    origin = now;
+    hasPending = reader.next(pending);
+  }
+
+  // Plays all records due at now, returns false once the trace is done
+  bool poll(const uint32_t now) {
+    while (hasPending && (int32_t)(now - origin - pending.time) >= 0) {
+      play(pending);
+      hasPending = reader.next(pending);
+    }
+    return hasPending;
+  }
+
+  // Plays the whole trace at once, ignoring the timing
+  void playAll() {
+    start(0);
+    while (hasPending) {
+      play(pending);
+      hasPending = reader.next(pending);
+    }
+  }
+
+private:
+  void play(const TraceRecord& record) {
+    switch (record.code) {
+      case TRACE_START_CLOCK:
+        controller.startClock();
+        break;
+      case TRACE_RESET:
+        controller.reset();
+        break;
+      default:
+        controller.writeRegister(record.code, record.data);
+        break;
+    }
+  }
+
+  Controller& controller;
+  TraceReader<Bytes> reader;
+  TraceRecord pending;
+  bool hasPending = false;
+  uint32_t origin = 0;
+};
+
+#if !defined(__AVR__) && defined(__linux__)
+// Read-only mapping of a trace file, bytes() is empty if it could not be mapped
+class MappedTrace
+{
+public:
+  explicit MappedTrace(const char* path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+      void* p = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        data = p;
+        size = (size_t)info.st_size;
+        madvise(data, size, MADV_SEQUENTIAL);
+      }
+    }
+    close(fd);
+  }
+
+  MappedTrace(const MappedTrace&) = delete;
+  MappedTrace& operator=(const MappedTrace&) = delete;
+
+  ~MappedTrace() {
+    if (data) {
+      munmap(data, size);
+    }
+  }
+
+  MemoryBytes bytes() const {
+    return MemoryBytes{(const uint8_t*)data, size};
+  }
+
+private:
+  void* data = nullptr;
+  size_t size = 0;
+};
+#endif
+
+} // namespace sid
+
+#endif
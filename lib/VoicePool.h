@@ -0,0 +1,335 @@
+/*
+  VoicePool - Polyphonic voice allocation across several Mos8561 Chips
+  Released into the public domain
+*/
+
+#ifndef VoicePool_h
+#define VoicePool_h
+
+#include "Clocks.h"
+#include "Mos8561.h"
+
+#include <stdint.h>
+
+
+namespace sid {
+
+const uint8_t NO_VOICE = 0xff;
+
+// Which voice to take over when a note starts and all voices are held.
+// Released voices are always reused first, longest released first.
+enum class VoiceStealing : uint8_t {
+  // Steal the voice that started playing first
+  Oldest,
+  // Steal the voice furthest into its envelope, sustaining before decaying
+  // before attacking. Sustaining voices go by the lowest level, decaying ones
+  // by the earliest end of the decay and attacking ones by the latest end of
+  // the attack, then the oldest. The phases are timed when the note starts,
+  // so a steal costs O(NUM_VOICES) comparisons and no divisions.
+  Quietest,
+  // Like Oldest, but a note that is still sounding restarts on its own voice
+  SameNote
+};
+
+namespace {
+  template<uint8_t... Indices>
+  struct IndexList {};
+
+  template<uint8_t N, uint8_t... Indices>
+  struct MakeIndexList : MakeIndexList<N - 1, N - 1, Indices...> {};
+
+  template<uint8_t... Indices>
+  struct MakeIndexList<0, Indices...> {
+    typedef IndexList<Indices...> type;
+  };
+
+  // Nominal attack times in milliseconds at 1 MHz,
+  // decay takes three times as long at the same setting
+  const uint16_t ATTACK_MILLIS[16] = {
+    2, 8, 16, 24, 38, 56, 68, 80, 100, 250, 500, 800, 1000, 3000, 5000, 8000
+  };
+
+  struct VoiceLinks {
+    uint8_t prev = NO_VOICE;
+    uint8_t next = NO_VOICE;
+  };
+
+  // Doubly linked list threaded through an array of links,
+  // so that voices move between lists in constant time
+  struct VoiceList {
+    void pushBack(VoiceLinks* links, const uint8_t voice) {
+      links[voice].prev = tail;
+      links[voice].next = NO_VOICE;
+      if (tail == NO_VOICE) {
+        head = voice;
+      } else {
+        links[tail].next = voice;
+      }
+      tail = voice;
+    }
+
+    void remove(VoiceLinks* links, const uint8_t voice) {
+      const uint8_t prev = links[voice].prev;
+      const uint8_t next = links[voice].next;
+      if (prev == NO_VOICE) {
+        head = next;
+      } else {
+        links[prev].next = next;
+      }
+      if (next == NO_VOICE) {
+        tail = prev;
+      } else {
+        links[next].prev = prev;
+      }
+      links[voice] = VoiceLinks();
+    }
+
+    uint8_t head = NO_VOICE;
+    uint8_t tail = NO_VOICE;
+  };
+}; // unnamed namespace
+
+// Owns one Mos8561 per chip and plays notes on whichever of the
+// NumChips * 3 voices is available, without allocating memory.
+// Time needs a method now() and a constant TICKS_PER_SECOND (see Clocks.h),
+// it tells how far the envelopes are for VoiceStealing::Quietest.
+template<typename Controller, uint8_t NumChips, uint32_t Clock = CLOCK_1MHZ,
+  typename Time = MicrosClock>
+class VoicePool
+{
+public:
+  static_assert(NumChips > 0 && NumChips <= 84, "Voices must be addressable by uint8_t");
+  static_assert(Time::TICKS_PER_SECOND >= 1000, "Envelopes are timed in milliseconds");
+  static const uint8_t NUM_VOICES = NumChips * 3;
+  typedef Mos8561<Controller, Clock> Chip;
+
+  explicit VoicePool(const Controller (&ctrs)[NumChips], const VoiceStealing policy = VoiceStealing::Oldest,
+      Time t = Time())
+    : VoicePool(ctrs, policy, t, typename MakeIndexList<NumChips>::type()) {
+  }
+
+  void start() {
+    for (uint8_t c = 0; c < NumChips; ++c) {
+      chips[c].start();
+    }
+  }
+
+  void setStealing(const VoiceStealing policy) {
+    stealing = policy;
+  }
+
+  Chip& chip(const uint8_t chipNum) {
+    assert(chipNum < NumChips);
+    return chips[chipNum];
+  }
+
+  void setVolume(const uint8_t vol) {
+    for (uint8_t c = 0; c < NumChips; ++c) {
+      chips[c].setVolume(vol);
+    }
+  }
+
+  void setWaveform(const Waveform waveform) {
+    for (uint8_t v = 0; v < NUM_VOICES; ++v) {
+      chipOf(v).setWaveform(channelOf(v), waveform);
+    }
+  }
+
+  void setPulseWidth(const uint16_t width) {
+    for (uint8_t v = 0; v < NUM_VOICES; ++v) {
+      chipOf(v).setPulseWidth(channelOf(v), width);
+    }
+  }
+
+  void setPitchBend(const int16_t bend) {
+    for (uint8_t v = 0; v < NUM_VOICES; ++v) {
+      chipOf(v).setPitchBend(channelOf(v), bend);
+    }
+  }
+
+  void setAdsr(const Adsr adsr) {
+    for (uint8_t v = 0; v < NUM_VOICES; ++v) {
+      setAdsr(v, adsr);
+    }
+  }
+
+  void setAdsr(const uint8_t voice, const Adsr adsr) {
+    assert(voice < NUM_VOICES);
+    voices[voice].attack = adsr.att & 0xf;
+    voices[voice].decay = adsr.dec & 0xf;
+    voices[voice].sustain = adsr.sus & 0xf;
+    chipOf(voice).setAdsr(channelOf(voice), adsr);
+  }
+
+  // Returns the voice the note plays on. A velocity of 0 releases the note.
+  uint8_t noteOn(const uint8_t note, const uint8_t velocity) {
+    assert(note < NUM_NOTES);
+    if (velocity == 0) {
+      noteOff(note);
+      return NO_VOICE;
+    }
+    uint8_t voice = voiceForNote[note];
+    if (voice != NO_VOICE && stealing == VoiceStealing::SameNote) {
+      // Restart the envelope on the voice the note is already sounding on
+      if (voices[voice].isHeld) {
+        unlinkHeld(voice);
+      } else {
+        released.remove(ageLinks, voice);
+      }
+      chipOf(voice).playNote(channelOf(voice), note, 0);
+    } else {
+      if (voice != NO_VOICE) {
+        noteOff(note);
+      }
+      voice = allocate();
+    }
+    voiceForNote[note] = voice;
+    voices[voice].note = note;
+    voices[voice].isHeld = true;
+    startEnvelope(voices[voice]);
+    held.pushBack(ageLinks, voice);
+    chipOf(voice).playNote(channelOf(voice), note, velocity);
+    return voice;
+  }
+
+  void noteOff(const uint8_t note) {
+    assert(note < NUM_NOTES);
+    const uint8_t voice = voiceForNote[note];
+    if (voice == NO_VOICE || !voices[voice].isHeld) {
+      return;
+    }
+    unlinkHeld(voice);
+    // The voice keeps its note while releasing so that it can be restarted
+    released.pushBack(ageLinks, voice);
+    chipOf(voice).playNote(channelOf(voice), note, 0);
+  }
+
+  void allNotesOff() {
+    while (held.head != NO_VOICE) {
+      noteOff(voices[held.head].note);
+    }
+  }
+
+  // Voice the note is held or releasing on, NO_VOICE if it is not sounding
+  uint8_t voiceOf(const uint8_t note) const {
+    assert(note < NUM_NOTES);
+    return voiceForNote[note];
+  }
+
+private:
+  struct Voice {
+    uint8_t note = NO_VOICE;
+    uint8_t attack = 0;
+    uint8_t decay = 0;
+    uint8_t sustain = 0;
+    bool isHeld = false;
+    // Ticks of Time at which the attack and the decay end
+    uint32_t attackEnd = 0;
+    uint32_t decayEnd = 0;
+  };
+
+  // Envelope phases of held voices, in the order they are stolen
+  enum class Phase : uint8_t {
+    Sustain,
+    Decay,
+    Attack
+  };
+
+  template<uint8_t... Indices>
+  VoicePool(const Controller (&ctrs)[NumChips], const VoiceStealing policy, Time t,
+      IndexList<Indices...>)
+    : chips{Chip(ctrs[Indices])...}
+    , stealing(policy)
+    , time(t) {
+    for (uint8_t n = 0; n < NUM_NOTES; ++n) {
+      voiceForNote[n] = NO_VOICE;
+    }
+    for (uint8_t v = 0; v < NUM_VOICES; ++v) {
+      released.pushBack(ageLinks, v);
+    }
+  }
+
+  static const uint32_t TICKS_PER_MILLI = Time::TICKS_PER_SECOND / 1000;
+
+  void startEnvelope(Voice& voice) {
+    voice.attackEnd = time.now() + ATTACK_MILLIS[voice.attack] * TICKS_PER_MILLI;
+    voice.decayEnd = voice.attackEnd + 3 * ATTACK_MILLIS[voice.decay] * TICKS_PER_MILLI;
+  }
+
+  Chip& chipOf(const uint8_t voice) {
+    return chips[voice / 3];
+  }
+
+  static uint8_t channelOf(const uint8_t voice) {
+    return voice % 3;
+  }
+
+  void unlinkHeld(const uint8_t voice) {
+    held.remove(ageLinks, voice);
+    voices[voice].isHeld = false;
+  }
+
+  uint8_t allocate() {
+    uint8_t voice = released.head;
+    if (voice != NO_VOICE) {
+      released.remove(ageLinks, voice);
+    } else {
+      voice = stealing == VoiceStealing::Quietest ? quietestHeld() : held.head;
+      unlinkHeld(voice);
+      // Gate off first, so that the envelope restarts for the new note
+      chipOf(voice).playNote(channelOf(voice), voices[voice].note, 0);
+    }
+    if (voices[voice].note != NO_VOICE && voiceForNote[voices[voice].note] == voice) {
+      voiceForNote[voices[voice].note] = NO_VOICE;
+    }
+    return voice;
+  }
+
+  uint8_t quietestHeld() const {
+    const uint32_t now = time.now();
+    uint8_t quietest = held.head;
+    Phase quietestPhase = phaseOf(voices[quietest], now);
+    for (uint8_t v = ageLinks[quietest].next; v != NO_VOICE; v = ageLinks[v].next) {
+      const Phase phase = phaseOf(voices[v], now);
+      if (phase < quietestPhase
+          || (phase == quietestPhase && isQuieter(voices[v], voices[quietest], phase, now))) {
+        quietest = v;
+        quietestPhase = phase;
+      }
+    }
+    return quietest;
+  }
+
+  // Signed differences keep working when now wraps around
+  static Phase phaseOf(const Voice& voice, const uint32_t now) {
+    return (int32_t)(now - voice.attackEnd) < 0 ? Phase::Attack
+      : (int32_t)(now - voice.decayEnd) < 0 ? Phase::Decay
+      : Phase::Sustain;
+  }
+
+  // Both voices are in phase, the ends still lie ahead of now
+  static bool isQuieter(const Voice& voice, const Voice& than, const Phase phase, const uint32_t now) {
+    switch (phase) {
+      case Phase::Attack:
+        return voice.attackEnd - now > than.attackEnd - now;
+      case Phase::Decay:
+        return voice.decayEnd - now < than.decayEnd - now;
+      default:
+        return voice.sustain < than.sustain;
+    }
+  }
+
+  Chip chips[NumChips];
+  VoiceStealing stealing;
+  Time time;
+  Voice voices[NUM_VOICES];
+  uint8_t voiceForNote[NUM_NOTES];
+  // Held voices by the time they started, released ones by the time they were released
+  VoiceLinks ageLinks[NUM_VOICES];
+  VoiceList held;
+  VoiceList released;
+};
+
+} // namespace sid
+
+#endif
@@ -1,4 +1,5 @@
 #include "Mos8561.h"
+#include "Sequencer.h"
 
 
 void printBinary(int inByte) {
@@ -64,6 +65,16 @@ struct Controller {
     waitCycles(2);
     digitalWrite(SID_SELECT_PIN, LOW);
   }
+
+  // Sends a whole transaction without being interrupted,
+  // so that all voices change at the same time
+  void writeRegisters(const byte* addresses, const byte* data, const byte count) {
+    noInterrupts();
+    for (byte i = 0; i < count; ++i) {
+      writeRegister(addresses[i], data[i]);
+    }
+    interrupts();
+  }
 private:
   void waitCycles(uint8_t numCycles) {
     delayMicroseconds(numCycles);
@@ -72,6 +83,45 @@ private:
 
 Controller controller;
 sid::Mos8561<Controller> synth(controller);
+sid::SequencePlayer<Controller> player(controller);
+
+// Test Sequencer, one step per tick. Compiled once in setup(),
+// playback only sends the precomputed register writes.
+const byte NOTE_SEQ[] = {45, 57, 69};
+const byte NUM_STEPS = 6;
+const unsigned long TICK_INTERVAL = 250;
+sid::SequenceOp program[32];
+
+// Timer2 interrupts at 1 kHz and plays whatever is due
+void startTickTimer() {
+  TCCR2A = (1 << WGM21);
+  TCCR2B = (1 << CS22);
+  OCR2A = 249;
+  TIMSK2 |= (1 << OCIE2A);
+}
+
+ISR(TIMER2_COMPA_vect) {
+  player.poll(millis());
+}
+
+void compileSequence() {
+  sid::Event pattern[2 * NUM_STEPS + 2];
+  byte numEvents = 0;
+  // The compiler starts from a blank chip, so the pattern sets up its voices
+  pattern[numEvents++] = sid::Event::setWaveform(0, 0, sid::Waveform::Triangle);
+  pattern[numEvents++] = sid::Event::setWaveform(0, 1, sid::Waveform::Triangle);
+  for (byte step = 0; step < NUM_STEPS; ++step) {
+    const byte note = NOTE_SEQ[step / 2];
+    const byte vel = step % 2 == 0 ? 127 : 0;
+    pattern[numEvents++] = sid::Event::noteOn(step, 0, note, vel);
+    pattern[numEvents++] = sid::Event::noteOn(step, 1, note + 3, vel);
+  }
+  sid::SequenceCompiler<> compiler(program, sizeof(program) / sizeof(program[0]));
+  if (!compiler.compile(pattern, numEvents)) {
+    Serial.println(F("Sequence does not fit"));
+  }
+  player.setProgram(program, compiler.size(), NUM_STEPS);
+}
 
 void setup() {
   Serial.begin(38400);
@@ -80,27 +130,23 @@ void setup() {
   synth.setVolume(127);
   for (int i = 0; i < 3; ++i) {
     synth.setAdsr(i, adsr);
-    synth.setWaveform(i, sid::Waveform::Triangle);
   }
+  compileSequence();
+  player.setTickInterval(TICK_INTERVAL);
+  player.setIsLooping(true);
+  player.start(millis());
+  startTickTimer();
 }
 
-// Test Sequencer
-byte note_seq[] = {45, 57, 69};
-long interval = 250;
-long prev = 0;
-byte vel = 127;
-byte index = 0;
+// The timer interrupt reads the tick interval, which takes more than one
+// instruction to write on AVR, so the tempo is changed with interrupts off
+void setTempo(const unsigned long tickInterval) {
+  noInterrupts();
+  player.setTickInterval(tickInterval);
+  interrupts();
+}
 
 void loop() {
-  auto current = millis();
-  if (current - prev > interval) {
-    prev = current;
-    if (vel > 0) {
-      index = index == 2 ? 0 : index + 1;
-    }
-    synth.playNote(0, note_seq[index], vel);
-    synth.playNote(1, note_seq[index] + 3, vel);
-//    synth.playNote(2, note_seq[index], vel);
-    vel = vel > 0 ? 0 : 127;
-  }
+  // Free for MIDI and UI, the timer plays the sequence on time.
+  // The tempo can be changed at any time with setTempo().
 }
@@ -0,0 +1,389 @@
+// Microbenchmarks for the register write path of Mos8561
+// Prints one JSON object per benchmark, or CSV with --csv.
+// With --latency it measures the Scheduler instead, see runLatency(),
+// with --midi [file] the MIDI parser, see runMidi(), and with --stats
+// [file] it reports where the writes of the MIDI stream come from, see runStats().
+
+#define MOS8561_INSTRUMENTATION
+
+#include <Instrumentation.h>
+#include <MidiInput.h>
+#include <Modulation.h>
+#include <Mos8561.h>
+#include <Scheduler.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <thread>
+#include <vector>
+
+
+struct Counters {
+  uint64_t writes = 0;
+  uint64_t checksum = 0;
+};
+
+// Counts writes and nothing else, so that only the cost of Mos8561 is measured
+struct CountingController {
+  explicit CountingController(Counters& c)
+    : counters(c) {
+  }
+
+  void startClock() {}
+
+  void reset() {}
+
+  void writeRegister(uint8_t address, uint8_t data) {
+    ++counters.writes;
+    counters.checksum += address ^ data;
+  }
+
+  Counters& counters;
+};
+
+typedef sid::Mos8561<CountingController> Synth;
+
+struct Result {
+  const char* name;
+  uint64_t events;
+  uint64_t calls;
+  uint64_t writes;
+  double ns;
+};
+
+// Runs fn for the given number of musical events, each of which
+// makes callsPerEvent API calls
+template<typename Fn>
+Result run(const char* name, const uint64_t events, const uint64_t callsPerEvent, Fn fn) {
+  Counters counters;
+  CountingController ctl(counters);
+  Synth synth(ctl);
+  synth.start();
+  synth.setVolume(127);
+  for (uint8_t v = 0; v < 3; ++v) {
+    synth.setWaveform(v, sid::Waveform::Square);
+  }
+  // Warm up, then count from a clean slate
+  for (uint64_t i = 0; i < events / 10; ++i) {
+    fn(synth, i);
+  }
+  counters.writes = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < events; ++i) {
+    fn(synth, i);
+  }
+  const auto end = std::chrono::steady_clock::now();
+  // Keep the writes observable
+  if (counters.checksum == 1) {
+    std::puts("");
+  }
+  const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+  return Result{name, events, events * callsPerEvent, counters.writes, ns};
+}
+
+const sid::Adsr PATCH_ADSR[2] = {
+  {0x2, 0x8, 0xA, 0x9},
+  {0x0, 0x4, 0xF, 0x3}
+};
+
+const uint8_t ARPEGGIO[] = {45, 48, 52, 57, 52, 48};
+
+uint32_t micros() {
+  static const auto epoch = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - epoch).count();
+}
+
+// Records when the lower pulse width byte of voice 1 is written
+struct TimingController {
+  explicit TimingController(std::vector<uint32_t>& t)
+    : times(t) {
+  }
+
+  void startClock() {}
+
+  void reset() {}
+
+  void writeRegister(uint8_t address, uint8_t) {
+    if (address == 2) {
+      times.push_back(micros());
+    }
+  }
+
+  std::vector<uint32_t>& times;
+};
+
+// Posts events due every 500us from the main thread and plays them from a
+// std::thread that ticks every 100us, then prints a histogram of how late
+// the writes happened
+int runLatency() {
+  typedef sid::Mos8561<TimingController> TimedSynth;
+  const uint32_t numEvents = 4000;
+  const uint32_t interval = 500;
+  const uint32_t bucketLimits[] = {10, 50, 100, 200, 500, 1000, 0xffffffff};
+  const size_t numBuckets = sizeof(bucketLimits) / sizeof(bucketLimits[0]);
+
+  std::vector<uint32_t> times;
+  times.reserve(numEvents);
+  TimingController ctl(times);
+  TimedSynth synth(ctl);
+  synth.start();
+  sid::Scheduler<TimedSynth, 64> scheduler(synth);
+
+  std::atomic<bool> isDone(false);
+  std::thread consumer([&]() {
+    while (!isDone.load() || !scheduler.isIdle()) {
+      scheduler.tick(micros());
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  });
+  std::vector<uint32_t> due(numEvents);
+  const uint32_t start = micros() + 10000;
+  for (uint32_t i = 0; i < numEvents; ++i) {
+    due[i] = start + i * interval;
+    // Every event changes the lower byte, so that each one is written
+    while (!scheduler.post(sid::Event::pulseWidth(due[i], 0, (i + 1) & 0xff))) {
+      std::this_thread::sleep_for(std::chrono::microseconds(interval));
+    }
+  }
+  isDone.store(true);
+  consumer.join();
+
+  std::vector<uint32_t> latencies(numEvents);
+  uint64_t buckets[numBuckets] = {};
+  for (uint32_t i = 0; i < numEvents; ++i) {
+    latencies[i] = times[i] - due[i];
+    size_t b = 0;
+    while (latencies[i] >= bucketLimits[b]) {
+      ++b;
+    }
+    ++buckets[b];
+  }
+  std::sort(latencies.begin(), latencies.end());
+  std::printf("{\"benchmark\": \"schedulerLatency\", \"events\": %u, \"p50_us\": %u, "
+    "\"p99_us\": %u, \"max_us\": %u, \"histogram_us\": {", numEvents,
+    latencies[numEvents / 2], latencies[numEvents * 99 / 100], latencies.back());
+  for (size_t b = 0; b < numBuckets; ++b) {
+    if (b + 1 < numBuckets) {
+      std::printf("\"<%u\": %llu, ", bucketLimits[b], (unsigned long long)buckets[b]);
+    } else {
+      std::printf("\">=%u\": %llu}}\n", bucketLimits[b - 1], (unsigned long long)buckets[b]);
+    }
+  }
+  return 0;
+}
+
+// A mix of notes, pitch bends and controller changes on three channels,
+// partly sent with running status
+std::vector<uint8_t> makeMidiStream(const size_t numBytes) {
+  std::vector<uint8_t> bytes;
+  bytes.reserve(numBytes + 16);
+  uint32_t i = 0;
+  while (bytes.size() < numBytes) {
+    const uint8_t channel = i % 3;
+    const uint8_t note = 36 + (i * 7) % 48;
+    const uint8_t msg[] = {
+      uint8_t(0x90 | channel), note, 100, note, 0,
+      uint8_t(0xe0 | channel), uint8_t(i & 0x7f), uint8_t((i >> 3) & 0x7f),
+      uint8_t(0xb0 | channel), 70, uint8_t(i & 0x7f), 73, uint8_t((i >> 2) & 0x7f), 0xf8
+    };
+    bytes.insert(bytes.end(), msg, msg + sizeof(msg));
+    ++i;
+  }
+  return bytes;
+}
+
+// Feeds a raw MIDI byte stream (not a Standard MIDI File) through MidiInput
+int runMidi(const char* path) {
+  std::vector<uint8_t> bytes;
+  if (path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      std::fprintf(stderr, "Cannot open %s\n", path);
+      return 1;
+    }
+    bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  } else {
+    bytes = makeMidiStream(1 << 20);
+  }
+  const int repeats = 20;
+  Counters counters;
+  CountingController ctl(counters);
+  Synth synth(ctl);
+  synth.start();
+  sid::MidiInput<Synth> midi(synth);
+  const auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < repeats; ++r) {
+    midi.parse(bytes.data(), bytes.size());
+  }
+  const auto end = std::chrono::steady_clock::now();
+  const double seconds = std::chrono::duration<double>(end - start).count();
+  const double messages = midi.numMessages();
+  std::printf("{\"benchmark\": \"midiInput\", \"bytes\": %llu, \"messages\": %.0f, "
+    "\"messages_per_second\": %.0f, \"mbytes_per_second\": %.2f, \"writes_per_message\": %.3f}\n",
+    (unsigned long long)bytes.size() * repeats, messages, messages / seconds,
+    bytes.size() * repeats / seconds / 1e6, messages > 0 ? counters.writes / messages : 0.);
+  return 0;
+}
+
+struct NanosClock {
+  uint32_t now() const {
+    return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+};
+
+// Plays the MIDI stream through an InstrumentedController and prints the
+// writes per entry point and register and the latency of the controller in ns
+int runStats(const char* path) {
+  typedef sid::InstrumentedController<CountingController, NanosClock> Instrumented;
+  typedef sid::Mos8561<Instrumented> InstrumentedSynth;
+  static const char* const CALL_NAMES[sid::NUM_API_CALLS] = {
+    "start", "setVolume", "setAdsr", "setWaveform", "setPulseWidth", "setFilterIsEnabled",
+    "playNote", "setPitchBend", "setFilter", "setControlBits", "applyPatch", "commit"
+  };
+  std::vector<uint8_t> bytes;
+  if (path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      std::fprintf(stderr, "Cannot open %s\n", path);
+      return 1;
+    }
+    bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  } else {
+    bytes = makeMidiStream(1 << 20);
+  }
+  Counters counters;
+  sid::ControllerStats stats;
+  InstrumentedSynth synth(Instrumented(CountingController(counters), stats));
+  synth.start();
+  sid::MidiInput<InstrumentedSynth> midi(synth);
+  midi.parse(bytes.data(), bytes.size());
+
+  std::printf("{\"benchmark\": \"writeStats\", \"messages\": %u, \"writes\": %u, \"calls\": {",
+    midi.numMessages(), stats.totalWrites());
+  for (uint8_t c = 0; c < sid::NUM_API_CALLS; ++c) {
+    std::printf("%s\"%s\": [%u, %u]", c > 0 ? ", " : "", CALL_NAMES[c],
+      stats.calls(sid::ApiCall(c)), stats.writes(sid::ApiCall(c)));
+  }
+  std::printf("}, \"registers\": {");
+  bool isFirst = true;
+  for (uint8_t a = 0; a < sid::NUM_REGISTERS; ++a) {
+    if (stats.writes(a) > 0) {
+      std::printf("%s\"0x%02x\": %u", isFirst ? "" : ", ", a, stats.writes(a));
+      isFirst = false;
+    }
+  }
+  const sid::LatencyHistogram& latency = stats.writeLatency;
+  std::printf("}, \"latency_ns\": {\"mean\": %.1f, \"max\": %u, \"histogram\": [",
+    latency.samples() > 0 ? (double)latency.total() / latency.samples() : 0., latency.longest());
+  for (uint8_t b = 0; b < sid::NUM_LATENCY_BUCKETS; ++b) {
+    std::printf("%s%u", b > 0 ? ", " : "", latency.count(b));
+  }
+  std::printf("]}}\n");
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1 && std::strcmp(argv[1], "--latency") == 0) {
+    return runLatency();
+  }
+  if (argc > 1 && std::strcmp(argv[1], "--midi") == 0) {
+    return runMidi(argc > 2 ? argv[2] : nullptr);
+  }
+  if (argc > 1 && std::strcmp(argv[1], "--stats") == 0) {
+    return runStats(argc > 2 ? argv[2] : nullptr);
+  }
+  const bool isCsv = argc > 1 && std::strcmp(argv[1], "--csv") == 0;
+  const uint64_t events = 1000000;
+
+  const Result results[] = {
+    // Note on followed by note off on the same voice
+    run("playNote", events, 1, [](Synth& s, uint64_t i) {
+      s.playNote(0, int(40 + (i >> 1) % 48), (i & 1) ? 0 : 127);
+    }),
+    run("setAdsr", events, 1, [](Synth& s, uint64_t i) {
+      s.setAdsr(i % 3, PATCH_ADSR[(i / 3) & 1]);
+    }),
+    run("setPulseWidth", events, 1, [](Synth& s, uint64_t i) {
+      s.setPulseWidth(i % 3, (i * 37) & 0xfff);
+    }),
+    run("setFilterIsEnabled", events, 1, [](Synth& s, uint64_t i) {
+      s.setFilterIsEnabled(i % 3, (i / 3) & 1);
+    }),
+    // Waveform, ADSR, pulse width and filter routing for all voices
+    run("patchLoad", events / 10, 12, [](Synth& s, uint64_t i) {
+      Synth::Transaction transaction(s);
+      for (uint8_t v = 0; v < 3; ++v) {
+        s.setWaveform(v, (i & 1) ? sid::Waveform::Saw : sid::Waveform::Square);
+        s.setAdsr(v, PATCH_ADSR[i & 1]);
+        s.setPulseWidth(v, (i & 1) ? 0x400 : 0x800);
+        s.setFilterIsEnabled(v, i & 1);
+      }
+    }),
+    // One step releases the previous note and starts the next
+    run("arpeggio", events, 2, [](Synth& s, uint64_t i) {
+      s.playNote(0, ARPEGGIO[i % 6], 0);
+      s.playNote(0, ARPEGGIO[(i + 1) % 6], 127);
+    }),
+    // Three note chords, alternating between on and off
+    run("chord", events, 3, [](Synth& s, uint64_t i) {
+      const int root = 48 + int((i >> 1) % 12);
+      const uint8_t velocity = (i & 1) ? 0 : 127;
+      s.playNote(0, root, velocity);
+      s.playNote(1, root + 4, velocity);
+      s.playNote(2, root + 7, velocity);
+    }),
+    // Cutoff going up and down by one step, as filter sweeps do
+    run("filterSweep", events, 1, [](Synth& s, uint64_t i) {
+      const uint16_t phase = i % 4094;
+      s.setFilterCutoff(phase < 2047 ? phase : 4094 - phase);
+    }),
+    // One 1 kHz control tick of vibrato and a pulse width sweep on all voices
+    run("modulation1kHz", events, 6, [](Synth& s, uint64_t i) {
+      const int16_t phase = i % 200;
+      const int16_t lfo = phase < 100 ? phase - 50 : 150 - phase;
+      for (uint8_t v = 0; v < 3; ++v) {
+        s.setPitchBend(v, lfo);
+        s.setPulseWidth(v, 2048 + lfo * 16);
+      }
+    }),
+    // The same through the modulation engine, writing only what changed
+    run("modulationEngine1kHz", events, 1,
+        [engine = std::unique_ptr<sid::ModulationEngine<Synth>>()](Synth& s, uint64_t) mutable {
+      if (!engine) {
+        engine.reset(new sid::ModulationEngine<Synth>(s));
+        for (uint8_t v = 0; v < 3; ++v) {
+          engine->setVibrato(v, sid::LfoShape::Triangle, sid::lfoRate(5.f, 1000), 100);
+          engine->setPulseWidthModulation(v, sid::LfoShape::Triangle, sid::lfoRate(5.f, 1000),
+            2048, 1600);
+        }
+      }
+      engine->tick();
+    })
+  };
+
+  if (isCsv) {
+    std::printf("benchmark,events,ns_per_call,ns_per_event,writes_per_event\n");
+  }
+  for (const auto& r : results) {
+    const double nsPerCall = r.ns / r.calls;
+    const double nsPerEvent = r.ns / r.events;
+    const double writesPerEvent = double(r.writes) / r.events;
+    if (isCsv) {
+      std::printf("%s,%llu,%.2f,%.2f,%.3f\n", r.name, (unsigned long long)r.events,
+        nsPerCall, nsPerEvent, writesPerEvent);
+    } else {
+      std::printf("{\"benchmark\": \"%s\", \"events\": %llu, \"ns_per_call\": %.2f, "
+        "\"ns_per_event\": %.2f, \"writes_per_event\": %.3f}\n", r.name,
+        (unsigned long long)r.events, nsPerCall, nsPerEvent, writesPerEvent);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,90 @@
+// Builds Instrumentation.h the way it is shipped, without
+// MOS8561_INSTRUMENTATION, next to tests.cpp which enables it
+
+#include <Instrumentation.h>
+#include <Mos8561.h>
+
+#include <catch2/catch.hpp>
+#include <utility>
+#include <vector>
+
+#ifdef MOS8561_INSTRUMENTATION
+#error "This file tests the disabled instrumentation"
+#endif
+
+
+namespace {
+  typedef std::vector<std::pair<uint8_t, uint8_t>> Writes;
+
+  struct PlainController {
+    void startClock() {
+      ++*numStarts;
+    }
+
+    void reset() {
+    }
+
+    void writeRegister(uint8_t address, uint8_t data) {
+      writes->push_back(std::make_pair(address, data));
+    }
+
+    int* numStarts;
+    Writes* writes;
+  };
+
+  struct BurstingController : PlainController {
+    void writeRegisters(const uint8_t* addresses, const uint8_t* data, const uint8_t count) {
+      bursts->push_back(count);
+      for (uint8_t i = 0; i < count; ++i) {
+        writeRegister(addresses[i], data[i]);
+      }
+    }
+
+    std::vector<uint8_t>* bursts;
+  };
+
+  static_assert(sizeof(sid::InstrumentedController<PlainController>) == sizeof(PlainController),
+    "Disabled instrumentation holds nothing but the controller");
+  static_assert(sizeof(sid::InstrumentedController<BurstingController>) == sizeof(BurstingController),
+    "Disabled instrumentation holds nothing but the controller");
+}
+
+TEST_CASE("Instrumentation Disabled") {
+  int numStarts = 0;
+  Writes writes;
+  std::vector<uint8_t> bursts;
+  sid::ControllerStats stats;
+  sid::Adsr adsr = {0x8, 0x3, 0xF, 0x4};
+
+  SECTION("Calls are forwarded and nothing is counted") {
+    typedef sid::InstrumentedController<PlainController> Instrumented;
+    sid::Mos8561<Instrumented> mos(Instrumented(PlainController{&numStarts, &writes}, stats));
+    mos.start();
+    mos.setAdsr(1, adsr);
+    mos.playNote(0, 69, 127);
+    REQUIRE(numStarts == 1);
+    REQUIRE(writes.size() == 5);
+    REQUIRE(writes.front() == std::make_pair<uint8_t, uint8_t>(12, 0x83));
+    REQUIRE(stats.totalWrites() == 0);
+    REQUIRE(stats.writes(sid::ApiCall::SetAdsr) == 0);
+    REQUIRE(stats.writeLatency.samples() == 0);
+  }
+
+  SECTION("Bursts are forwarded") {
+    typedef sid::InstrumentedController<BurstingController> Instrumented;
+    BurstingController ctl;
+    ctl.numStarts = &numStarts;
+    ctl.writes = &writes;
+    ctl.bursts = &bursts;
+    sid::Mos8561<Instrumented> mos(Instrumented(ctl, stats));
+    mos.start();
+    mos.begin();
+    mos.setAdsr(0, adsr);
+    mos.setAdsr(2, adsr);
+    mos.commit();
+    REQUIRE(bursts.size() == 1);
+    REQUIRE(bursts.front() == 4);
+    REQUIRE(writes.size() == 4);
+    REQUIRE(stats.burstLatency.samples() == 0);
+  }
+}
@@ -0,0 +1,377 @@
+// Offline renderer of register traces (see Trace.h) to 16 bit mono WAV files
+// Renders all jobs in parallel on a work-stealing pool and prints one JSON
+// object with the throughput, or one per thread count with --scaling.
+//
+// render_mos8561 [-j threads] [-o dir] [-r rate] [-q point|fast|good|best] [--demo count]
+//   [--scaling] [traces...]
+//
+// Without traces it renders count generated sequences (64 by default).
+
+#include <Clocks.h>
+#include <Mos8561.h>
+#include <SidEmulator.h>
+#include <Trace.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// Audio rendered after the last write, so that releases ring out
+const double TAIL_SECONDS = 0.5;
+const size_t FRAMES_PER_WRITE = 4096;
+const size_t FILE_BUFFER_SIZE = 1 << 16;
+
+struct Job {
+  sid::MemoryBytes trace;
+  std::string path;
+};
+
+// Each worker owns a deque of job indices. It takes from the back of its
+// own and steals from the front of the others once it runs dry. Jobs are
+// whole renders, so a mutex per deque costs nothing measurable.
+class WorkStealingPool
+{
+public:
+  explicit WorkStealingPool(const size_t numWorkers) {
+    for (size_t i = 0; i < numWorkers; ++i) {
+      queues.emplace_back(new Queue());
+    }
+  }
+
+  void add(const size_t job) {
+    Queue& queue = *queues[numAdded++ % queues.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.jobs.push_back(job);
+  }
+
+  bool take(const size_t worker, size_t& job) {
+    {
+      Queue& own = *queues[worker];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.jobs.empty()) {
+        job = own.jobs.back();
+        own.jobs.pop_back();
+        return true;
+      }
+    }
+    for (size_t i = 1; i < queues.size(); ++i) {
+      Queue& victim = *queues[(worker + i) % queues.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.jobs.empty()) {
+        job = victim.jobs.front();
+        victim.jobs.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<size_t> jobs;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  size_t numAdded = 0;
+};
+
+// Allocated once per thread and reused for all of its renders
+struct WorkerBuffers {
+  WorkerBuffers()
+    : samples(FRAMES_PER_WRITE)
+    , bytes(FRAMES_PER_WRITE * 2)
+    , file(FILE_BUFFER_SIZE) {
+  }
+
+  std::vector<int16_t> samples;
+  std::vector<uint8_t> bytes;
+  std::vector<char> file;
+};
+
+void putLe(uint8_t* p, const uint32_t value, const int size) {
+  for (int i = 0; i < size; ++i) {
+    p[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+bool writeWavHeader(FILE* f, const uint32_t rate, const uint32_t numFrames) {
+  uint8_t header[44];
+  const uint32_t dataSize = numFrames * 2;
+  memcpy(header, "RIFF", 4);
+  putLe(header + 4, 36 + dataSize, 4);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  putLe(header + 16, 16, 4);
+  putLe(header + 20, 1, 2);
+  putLe(header + 22, 1, 2);
+  putLe(header + 24, rate, 4);
+  putLe(header + 28, rate * 2, 4);
+  putLe(header + 32, 2, 2);
+  putLe(header + 34, 16, 2);
+  memcpy(header + 36, "data", 4);
+  putLe(header + 40, dataSize, 4);
+  return fwrite(header, 1, sizeof(header), f) == sizeof(header);
+}
+
+// Plays the trace into an emulator and streams the audio to path,
+// returns the number of frames written or 0 on failure, e.g. a full disk.
+// A file that could not be written completely is removed.
+uint64_t renderTrace(const Job& job, const uint32_t rate, const sid::RenderQuality quality,
+    WorkerBuffers& buffers) {
+  sid::TraceReader<sid::MemoryBytes> reader(job.trace);
+  if (!reader.isValid()) {
+    return 0;
+  }
+  FILE* f = fopen(job.path.c_str(), "wb");
+  if (!f) {
+    return 0;
+  }
+  setvbuf(f, buffers.file.data(), _IOFBF, buffers.file.size());
+  // The sizes are patched once the length is known
+  bool isWritten = writeWavHeader(f, rate, 0);
+
+  sid::Emulator emulator(rate, sid::CLOCK_1MHZ, quality);
+  uint64_t numFrames = 0;
+  auto renderUntil = [&](const uint64_t frame) {
+    while (isWritten && numFrames < frame) {
+      const size_t n = (size_t)std::min<uint64_t>(frame - numFrames, FRAMES_PER_WRITE);
+      emulator.render(buffers.samples.data(), n);
+      for (size_t i = 0; i < n; ++i) {
+        putLe(&buffers.bytes[i * 2], (uint16_t)buffers.samples[i], 2);
+      }
+      isWritten = fwrite(buffers.bytes.data(), 2, n, f) == n;
+      numFrames += n;
+    }
+  };
+
+  // isValid() has rejected a rate of 0
+  const uint64_t ticksPerSecond = reader.ticksPerSecond();
+  sid::TraceRecord record;
+  while (isWritten && reader.next(record)) {
+    renderUntil(record.time * (uint64_t)rate / ticksPerSecond);
+    switch (record.code) {
+      case sid::TRACE_START_CLOCK:
+        emulator.startClock();
+        break;
+      case sid::TRACE_RESET:
+        emulator.reset();
+        break;
+      default:
+        emulator.writeRegister(record.code, record.data);
+        break;
+    }
+  }
+  renderUntil(numFrames + (uint64_t)(TAIL_SECONDS * rate));
+
+  isWritten = isWritten && fseek(f, 0, SEEK_SET) == 0
+    && writeWavHeader(f, rate, (uint32_t)numFrames) && fflush(f) == 0 && !ferror(f);
+  if (fclose(f) != 0 || !isWritten) {
+    std::remove(job.path.c_str());
+    return 0;
+  }
+  return numFrames;
+}
+
+struct VectorSink {
+  void put(const uint8_t byte) {
+    bytes.push_back(byte);
+  }
+
+  std::vector<uint8_t> bytes;
+};
+
+struct NullController {
+  void startClock() {}
+
+  void reset() {}
+
+  void writeRegister(uint8_t, uint8_t) {}
+};
+
+// Records a few seconds of arpeggios, with a patch that depends on seed
+std::vector<uint8_t> makeDemoTrace(const uint32_t seed) {
+  typedef sid::TraceWriter<VectorSink, sid::ManualClock> Writer;
+  typedef sid::RecordingController<NullController, Writer> Recorder;
+  static const int CHORDS[4][3] = {{0, 4, 7}, {0, 3, 7}, {0, 5, 9}, {0, 4, 9}};
+  static const sid::Waveform WAVEFORMS[3] = {
+    sid::Waveform::Saw, sid::Waveform::Square, sid::Waveform::Triangle
+  };
+  const uint32_t STEP_TICKS = 125000;
+
+  uint32_t now = 0;
+  VectorSink sink;
+  Writer writer(sink, sid::ManualClock(now));
+  sid::Mos8561<Recorder> mos(Recorder(NullController(), writer));
+  mos.start();
+  mos.setVolume(100);
+  for (uint8_t v = 0; v < 3; ++v) {
+    mos.setWaveform(v, WAVEFORMS[(seed + v) % 3]);
+    mos.setPulseWidth(v, 1024 + 512 * v);
+    mos.setAdsr(v, sid::Adsr{(uint8_t)(seed % 4), 6, 8, (uint8_t)(4 + seed % 6)});
+  }
+  const int root = 36 + (int)(seed % 24);
+  for (uint32_t step = 0; step < 32; ++step) {
+    const int* chord = CHORDS[(step / 8 + seed) % 4];
+    const uint8_t v = step % 3;
+    mos.playNote(v, root + chord[v] + 12 * (int)((step / 3) % 2), 100);
+    mos.setPitchBend(v, (int16_t)((step * 37 + seed) % 64 - 32));
+    now += STEP_TICKS;
+    mos.playNote(v, root + chord[v] + 12 * (int)((step / 3) % 2), 0);
+  }
+  return sink.bytes;
+}
+
+struct Result {
+  uint64_t renders = 0;
+  uint64_t failures = 0;
+  uint64_t frames = 0;
+  double seconds = 0;
+};
+
+Result renderAll(const std::vector<Job>& jobs, const size_t numThreads, const uint32_t rate,
+    const sid::RenderQuality quality) {
+  WorkStealingPool pool(numThreads);
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    pool.add(i);
+  }
+  std::atomic<uint64_t> renders{0};
+  std::atomic<uint64_t> failures{0};
+  std::atomic<uint64_t> frames{0};
+
+  const auto begin = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t w = 0; w < numThreads; ++w) {
+    threads.emplace_back([&, w]() {
+      WorkerBuffers buffers;
+      size_t job;
+      while (pool.take(w, job)) {
+        const uint64_t n = renderTrace(jobs[job], rate, quality, buffers);
+        if (n > 0) {
+          renders.fetch_add(1, std::memory_order_relaxed);
+          frames.fetch_add(n, std::memory_order_relaxed);
+        } else {
+          std::fprintf(stderr, "failed to render %s\n", jobs[job].path.c_str());
+          failures.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+    });
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+
+  Result result;
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  result.renders = renders;
+  result.failures = failures;
+  result.frames = frames;
+  return result;
+}
+
+void printResult(const Result& result, const size_t numThreads, const uint32_t rate) {
+  const double audioSeconds = (double)result.frames / rate;
+  std::printf("{\"threads\": %zu, \"renders\": %llu, \"failures\": %llu, \"seconds\": %.3f, "
+      "\"rendersPerSecond\": %.2f, \"audioSeconds\": %.1f, \"realtimeFactor\": %.1f}\n",
+    numThreads, (unsigned long long)result.renders, (unsigned long long)result.failures,
+    result.seconds, result.renders / result.seconds, audioSeconds, audioSeconds / result.seconds);
+}
+
+std::string baseName(const std::string& path) {
+  const size_t slash = path.find_last_of('/');
+  std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+  const size_t dot = name.find_last_of('.');
+  return dot == std::string::npos ? name : name.substr(0, dot);
+}
+
+int main(int argc, char** argv) {
+  size_t numThreads = std::max(1u, std::thread::hardware_concurrency());
+  std::string outDir = ".";
+  uint32_t rate = 44100;
+  uint32_t numDemos = 64;
+  bool isScaling = false;
+  sid::RenderQuality quality = sid::RenderQuality::Good;
+  std::vector<const char*> paths;
+  for (int i = 1; i < argc; ++i) {
+    const bool hasValue = i + 1 < argc;
+    if (std::strcmp(argv[i], "-j") == 0 && hasValue) {
+      numThreads = std::max(1, std::atoi(argv[++i]));
+    } else if (std::strcmp(argv[i], "-o") == 0 && hasValue) {
+      outDir = argv[++i];
+    } else if (std::strcmp(argv[i], "-r") == 0 && hasValue) {
+      rate = (uint32_t)std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "-q") == 0 && hasValue) {
+      const char* q = argv[++i];
+      quality = std::strcmp(q, "point") == 0 ? sid::RenderQuality::PointSampled
+        : std::strcmp(q, "fast") == 0 ? sid::RenderQuality::Fast
+        : std::strcmp(q, "best") == 0 ? sid::RenderQuality::Best
+        : sid::RenderQuality::Good;
+    } else if (std::strcmp(argv[i], "--demo") == 0 && hasValue) {
+      numDemos = (uint32_t)std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--scaling") == 0) {
+      isScaling = true;
+    } else if (argv[i][0] == '-') {
+      std::fprintf(stderr, "usage: %s [-j threads] [-o dir] [-r rate] [-q point|fast|good|best] "
+        "[--demo count] [--scaling] [traces...]\n", argv[0]);
+      return 1;
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+  if (rate < 8000) {
+    std::fprintf(stderr, "rate must be at least 8000\n");
+    return 1;
+  }
+
+  // Keeps the traces mapped or in memory for as long as the jobs refer to them
+  std::vector<std::unique_ptr<sid::MappedTrace>> files;
+  std::vector<std::vector<uint8_t>> demos;
+  std::vector<Job> jobs;
+  if (paths.empty()) {
+    for (uint32_t i = 0; i < numDemos; ++i) {
+      demos.push_back(makeDemoTrace(i));
+    }
+    for (uint32_t i = 0; i < numDemos; ++i) {
+      char name[32];
+      std::snprintf(name, sizeof(name), "/demo_%03u.wav", i);
+      jobs.push_back(Job{sid::MemoryBytes{demos[i].data(), demos[i].size()}, outDir + name});
+    }
+  }
+  for (const char* path : paths) {
+    files.emplace_back(new sid::MappedTrace(path));
+    if (files.back()->bytes().size == 0) {
+      std::fprintf(stderr, "cannot read %s\n", path);
+      return 1;
+    }
+    jobs.push_back(Job{files.back()->bytes(), outDir + "/" + baseName(path) + ".wav"});
+  }
+  // Traces with the same name in different directories would overwrite each other
+  std::set<std::string> outputs;
+  for (const Job& job : jobs) {
+    if (!outputs.insert(job.path).second) {
+      std::fprintf(stderr, "more than one trace renders to %s\n", job.path.c_str());
+      return 1;
+    }
+  }
+
+  if (isScaling) {
+    const size_t maxThreads = numThreads;
+    for (numThreads = 1; numThreads < maxThreads; numThreads *= 2) {
+      printResult(renderAll(jobs, numThreads, rate, quality), numThreads, rate);
+    }
+    numThreads = maxThreads;
+  }
+  const Result result = renderAll(jobs, numThreads, rate, quality);
+  printResult(result, numThreads, rate);
+  return result.failures == 0 ? 0 : 1;
+}
@@ -1,9 +1,24 @@
 #define CATCH_CONFIG_MAIN
+#define MOS8561_COUNT_SUPPRESSED_WRITES
+#define MOS8561_INSTRUMENTATION
 
+#include <Clocks.h>
+#include <Instrumentation.h>
 #include <Mos8561.h>
+#include <MidiInput.h>
+#include <Modulation.h>
+#include <Scheduler.h>
+#include <Sequencer.h>
+#include <SidEmulator.h>
+#include <Trace.h>
+#include <VoicePool.h>
 
 #include <catch2/catch.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
 #include <functional>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -199,13 +214,12 @@ TEST_CASE("Mos8561") {
     REQUIRE(writeRegisterCallback.vec.at(3).first == 4);
     REQUIRE(writeRegisterCallback.vec.at(3).second == 0b01000001);
 
+    // The frequency is unchanged, so only the control byte is written
     mos.playNote(voiceNum, note, 0);
-    REQUIRE(writeRegisterCallback.vec.at(4).first == 0);
-    REQUIRE(writeRegisterCallback.vec.at(4).second == 0x6B);
-    REQUIRE(writeRegisterCallback.vec.at(5).first == 1);
-    REQUIRE(writeRegisterCallback.vec.at(5).second == 0x0E);
-    REQUIRE(writeRegisterCallback.vec.at(6).first == 4);
-    REQUIRE(writeRegisterCallback.vec.at(6).second == 0b01000000);
+    CHECK(writeRegisterCallback.vec.size() == 5);
+    REQUIRE(writeRegisterCallback.vec.at(4).first == 4);
+    REQUIRE(writeRegisterCallback.vec.at(4).second == 0b01000000);
+    REQUIRE(mos.suppressedWrites() == 2);
   }
 
   SECTION("Play Note On and Off with second Voice") {
@@ -223,13 +237,12 @@ TEST_CASE("Mos8561") {
     REQUIRE(writeRegisterCallback.vec.at(3).first == 11);
     REQUIRE(writeRegisterCallback.vec.at(3).second == 0b00010001);
 
+    // The frequency is unchanged, so only the control byte is written
     mos.playNote(voiceNum, note, 0);
-    REQUIRE(writeRegisterCallback.vec.at(4).first == 7);
-    REQUIRE(writeRegisterCallback.vec.at(4).second == 0x93);
-    REQUIRE(writeRegisterCallback.vec.at(5).first == 8);
-    REQUIRE(writeRegisterCallback.vec.at(5).second == 0x08);
-    REQUIRE(writeRegisterCallback.vec.at(6).first == 11);
-    REQUIRE(writeRegisterCallback.vec.at(6).second == 0b00010000);
+    CHECK(writeRegisterCallback.vec.size() == 5);
+    REQUIRE(writeRegisterCallback.vec.at(4).first == 11);
+    REQUIRE(writeRegisterCallback.vec.at(4).second == 0b00010000);
+    REQUIRE(mos.suppressedWrites() == 2);
   }
 
   SECTION("Play Note On and Off with third Voice") {
@@ -247,13 +260,12 @@ TEST_CASE("Mos8561") {
     REQUIRE(writeRegisterCallback.vec.at(3).first == 18);
     REQUIRE(writeRegisterCallback.vec.at(3).second == 0b00100001);
 
+    // The frequency is unchanged, so only the control byte is written
     mos.playNote(voiceNum, note, 0);
-    REQUIRE(writeRegisterCallback.vec.at(4).first == 14);
-    REQUIRE(writeRegisterCallback.vec.at(4).second == 0x34);
-    REQUIRE(writeRegisterCallback.vec.at(5).first == 15);
-    REQUIRE(writeRegisterCallback.vec.at(5).second == 0x01);
-    REQUIRE(writeRegisterCallback.vec.at(6).first == 18);
-    REQUIRE(writeRegisterCallback.vec.at(6).second == 0b00100000);
+    CHECK(writeRegisterCallback.vec.size() == 5);
+    REQUIRE(writeRegisterCallback.vec.at(4).first == 18);
+    REQUIRE(writeRegisterCallback.vec.at(4).second == 0b00100000);
+    REQUIRE(mos.suppressedWrites() == 2);
   }
 
   SECTION("Enable/Disable Filter") {
@@ -278,3 +290,1511 @@ TEST_CASE("Mos8561") {
     REQUIRE(writeRegisterCallback.vec.at(3).second == 0b00000110);
   }
 }
+
+TEST_CASE("Mos8561 Redundant Writes") {
+  Callback startClockCallback;
+  Callback resetCallback;
+  RegisterCallback writeRegisterCallback;
+  MockController ctl(startClockCallback, resetCallback, writeRegisterCallback);
+  sid::Mos8561<MockController> mos(ctl);
+
+  SECTION("Writes before start are never suppressed") {
+    mos.setPulseWidth(0, 0);
+    REQUIRE(writeRegisterCallback.vec.size() == 2);
+    REQUIRE(mos.suppressedWrites() == 0);
+  }
+
+  SECTION("Repeated writes are suppressed") {
+    sid::Adsr adsr = {0x8, 0x3, 0xF, 0x4};
+    mos.setAdsr(0, adsr);
+    mos.setAdsr(0, adsr);
+    REQUIRE(writeRegisterCallback.vec.size() == 2);
+    REQUIRE(mos.suppressedWrites() == 2);
+
+    mos.setVolume(127);
+    mos.setVolume(127);
+    REQUIRE(writeRegisterCallback.vec.size() == 3);
+    REQUIRE(mos.suppressedWrites() == 3);
+  }
+
+  SECTION("Only changed bytes are written") {
+    mos.setPulseWidth(1, 1234);
+    mos.setPulseWidth(1, 1235);
+    REQUIRE(writeRegisterCallback.vec.size() == 3);
+    REQUIRE(writeRegisterCallback.vec.back().first == 9);
+    REQUIRE(writeRegisterCallback.vec.back().second == 0b11010011);
+    REQUIRE(mos.suppressedWrites() == 1);
+  }
+
+  SECTION("Start clears all registers") {
+    mos.start();
+    mos.setPulseWidth(2, 0);
+    mos.setFilterIsEnabled(0, false);
+    mos.setAdsr(1, {0, 0, 0, 0});
+    REQUIRE(writeRegisterCallback.vec.size() == 0);
+    REQUIRE(mos.suppressedWrites() == 5);
+
+    mos.setPulseWidth(2, 256);
+    REQUIRE(writeRegisterCallback.vec.size() == 1);
+    REQUIRE(writeRegisterCallback.vec.front().first == 17);
+    REQUIRE(writeRegisterCallback.vec.front().second == 1);
+  }
+
+  SECTION("Invalidate resyncs all registers") {
+    mos.start();
+    mos.setVolume(127);
+    mos.invalidate();
+    mos.setVolume(127);
+    mos.setFilterIsEnabled(0, false);
+    REQUIRE(writeRegisterCallback.vec.size() == 3);
+    REQUIRE(mos.suppressedWrites() == 0);
+    mos.setVolume(127);
+    REQUIRE(mos.suppressedWrites() == 1);
+  }
+}
+
+TEST_CASE("Note Table") {
+  SECTION("Frequency words depend on the clock") {
+    REQUIRE(sid::FrequencyTable<sid::CLOCK_1MHZ>::words[0] == 137);
+    REQUIRE(sid::FrequencyTable<sid::CLOCK_1MHZ>::words[69] == 7382);
+    REQUIRE(sid::FrequencyTable<sid::CLOCK_PAL>::words[69] == 7493);
+    REQUIRE(sid::FrequencyTable<sid::CLOCK_NTSC>::words[69] == 7218);
+    REQUIRE(sid::FrequencyTable<sid::CLOCK_NTSC>::words[106] == 61177);
+  }
+
+  SECTION("Notes too high for the clock are clamped") {
+    REQUIRE(sid::FrequencyTable<sid::CLOCK_1MHZ>::words[107] == 0xffff);
+    REQUIRE(sid::FrequencyTable<sid::CLOCK_1MHZ>::words[127] == 0xffff);
+  }
+
+  SECTION("Pitches between notes are interpolated") {
+    REQUIRE(sid::pitchAsWord<sid::CLOCK_1MHZ>(69 * 256) == 7382);
+    REQUIRE(sid::pitchAsWord<sid::CLOCK_1MHZ>(69 * 256 + 128) == 7601);
+    REQUIRE(sid::pitchAsWord<sid::CLOCK_1MHZ>(-100) == 137);
+    REQUIRE(sid::pitchAsWord<sid::CLOCK_1MHZ>(200 * 256) == 0xffff);
+  }
+}
+
+TEST_CASE("Mos8561 Pitch") {
+  Callback startClockCallback;
+  Callback resetCallback;
+  RegisterCallback writeRegisterCallback;
+  MockController ctl(startClockCallback, resetCallback, writeRegisterCallback);
+
+  SECTION("PAL clock") {
+    sid::Mos8561<MockController, sid::CLOCK_PAL> mos(ctl);
+    mos.playNote(0, 69, 127);
+    REQUIRE(writeRegisterCallback.vec.at(0).second == (7493 & 0xff));
+    REQUIRE(writeRegisterCallback.vec.at(1).second == (7493 >> 8));
+  }
+
+  SECTION("Fractional notes") {
+    sid::Mos8561<MockController> mos(ctl);
+    mos.playNote(0, 69.5, 127);
+    REQUIRE(writeRegisterCallback.vec.at(0).second == (7601 & 0xff));
+    REQUIRE(writeRegisterCallback.vec.at(1).second == (7601 >> 8));
+  }
+
+  SECTION("Pitch bend") {
+    sid::Mos8561<MockController> mos(ctl);
+    mos.start();
+    mos.setWaveform(1, sid::Waveform::Saw);
+    mos.playNote(1, 69, 127);
+    mos.setPitchBend(1, 128);
+    REQUIRE(writeRegisterCallback.vec.size() == 6);
+    REQUIRE(writeRegisterCallback.vec.at(4).first == 7);
+    REQUIRE(writeRegisterCallback.vec.at(4).second == (7601 & 0xff));
+    REQUIRE(writeRegisterCallback.vec.at(5).first == 8);
+    REQUIRE(writeRegisterCallback.vec.at(5).second == (7601 >> 8));
+
+    // The bend stays in place for the next note
+    mos.playNote(1, 68, 127);
+    REQUIRE(writeRegisterCallback.vec.at(6).first == 7);
+    REQUIRE(writeRegisterCallback.vec.at(6).second == (7175 & 0xff));
+  }
+
+  SECTION("Out of range notes clamp") {
+    const uint16_t highest = sid::FrequencyTable<sid::CLOCK_1MHZ>::words[sid::NUM_NOTES - 1];
+    const uint16_t lowest = sid::FrequencyTable<sid::CLOCK_1MHZ>::words[0];
+    auto frequency = [&writeRegisterCallback]() {
+      const size_t n = writeRegisterCallback.vec.size();
+      return (uint16_t)(writeRegisterCallback.vec.at(n - 2).second
+        | writeRegisterCallback.vec.at(n - 1).second << 8);
+    };
+    sid::Mos8561<MockController> mos(ctl);
+    mos.start();
+
+    mos.playNote(0, 127, 0);
+    REQUIRE(frequency() == highest);
+    for (const int note : {128, 255, 1000, 100000}) {
+      mos.playNote(0, 0, 0);
+      mos.playNote(0, note, 0);
+      REQUIRE(frequency() == highest);
+      mos.playNote<1>(0, 0);
+      mos.playNote<1>(note, 0);
+      REQUIRE(frequency() == highest);
+      mos.playNote(2, 0, 0);
+      mos.playNote(2, (double)note, 0);
+      REQUIRE(frequency() == highest);
+    }
+    mos.playNote(0, -100000, 0);
+    REQUIRE(frequency() == lowest);
+    mos.playNote(0, -1000.0, 0);
+    REQUIRE(frequency() == lowest);
+  }
+
+  SECTION("Notes of any arithmetic type") {
+    const uint16_t a4 = sid::FrequencyTable<sid::CLOCK_1MHZ>::words[69];
+    const uint16_t highest = sid::FrequencyTable<sid::CLOCK_1MHZ>::words[sid::NUM_NOTES - 1];
+    auto frequency = [&writeRegisterCallback]() {
+      const size_t n = writeRegisterCallback.vec.size();
+      return (uint16_t)(writeRegisterCallback.vec.at(n - 2).second
+        | writeRegisterCallback.vec.at(n - 1).second << 8);
+    };
+    sid::Mos8561<MockController> mos(ctl);
+    mos.start();
+
+    mos.playNote(0, 69u, 0);
+    REQUIRE(frequency() == a4);
+    mos.playNote(1, 69l, 0);
+    REQUIRE(frequency() == a4);
+    mos.playNote<2>((size_t)69, 0);
+    REQUIRE(frequency() == a4);
+    mos.playNote(0, 0u, 0);
+    mos.playNote(0, (uint16_t)69, 0);
+    REQUIRE(frequency() == a4);
+    mos.playNote(0, 69.0f, 0);
+    REQUIRE(frequency() == a4);
+
+    mos.playNote(0, 4000000000u, 0);
+    REQUIRE(frequency() == highest);
+    mos.playNote(1, 1l << 40, 0);
+    REQUIRE(frequency() == highest);
+  }
+}
+
+namespace {
+  // Counts sign changes, i.e. twice the frequency for periodic waveforms
+  size_t countZeroCrossings(const std::vector<float>& samples) {
+    size_t crossings = 0;
+    for (size_t i = 1; i < samples.size(); ++i) {
+      crossings += (samples[i - 1] < 0.f) != (samples[i] < 0.f);
+    }
+    return crossings;
+  }
+
+  float rms(const std::vector<float>& samples) {
+    float sum = 0.f;
+    for (const auto s : samples) {
+      sum += s * s;
+    }
+    return std::sqrt(sum / samples.size());
+  }
+
+  // Magnitude of the component at hz, normalised to the amplitude of a sine
+  float goertzel(const std::vector<float>& samples, const double hz, const double rate) {
+    const double coeff = 2.0 * std::cos(2.0 * M_PI * hz / rate);
+    double s1 = 0.0;
+    double s2 = 0.0;
+    for (const auto x : samples) {
+      const double s0 = x + coeff * s1 - s2;
+      s2 = s1;
+      s1 = s0;
+    }
+    return (float)(2.0 * std::sqrt(s1 * s1 + s2 * s2 - coeff * s1 * s2) / samples.size());
+  }
+
+  // Share of the energy that is not at a multiple of the fundamental, i.e.
+  // aliases and noise. The samples are Blackman-Harris windowed, so that
+  // the harmonics do not leak into each other.
+  double inharmonicEnergy(std::vector<float> samples, const double fundamental, const double rate) {
+    std::vector<double> windowed(samples.size());
+    double windowSum = 0.0;
+    double windowEnergy = 0.0;
+    double total = 0.0;
+    for (size_t i = 0; i < samples.size(); ++i) {
+      const double p = 2.0 * M_PI * i / (samples.size() - 1);
+      const double w = 0.35875 - 0.48829 * std::cos(p) + 0.14128 * std::cos(2.0 * p)
+        - 0.01168 * std::cos(3.0 * p);
+      windowed[i] = samples[i] * w;
+      windowSum += w;
+      windowEnergy += w * w;
+      total += windowed[i] * windowed[i];
+    }
+    double harmonic = 0.0;
+    for (int k = 0; k * fundamental < rate / 2; ++k) {
+      const double coeff = 2.0 * std::cos(2.0 * M_PI * k * fundamental / rate);
+      double s1 = 0.0;
+      double s2 = 0.0;
+      for (const auto x : windowed) {
+        const double s0 = x + coeff * s1 - s2;
+        s2 = s1;
+        s1 = s0;
+      }
+      // Amplitude of the component, twice that for DC
+      const double a = 2.0 * std::sqrt(std::max(0.0, s1 * s1 + s2 * s2 - coeff * s1 * s2)) / windowSum;
+      harmonic += a * a * windowEnergy / (k == 0 ? 4.0 : 2.0);
+    }
+    return std::max(0.0, total - harmonic) / total;
+  }
+}
+
+TEST_CASE("Emulator") {
+  sid::Emulator emu(44100, sid::CLOCK_1MHZ, sid::RenderQuality::PointSampled);
+  sid::EmulatedController ctl(emu);
+  sid::Mos8561<sid::EmulatedController> mos(ctl);
+  std::vector<float> samples(44100);
+
+  SECTION("Silent without clock") {
+    mos.setVolume(127);
+    mos.setAdsr(0, {0, 0, 0xF, 0});
+    mos.setWaveform(0, sid::Waveform::Saw);
+    mos.playNote(0, 69, 127);
+    emu.render(samples.data(), samples.size());
+    REQUIRE(rms(samples) == 0.f);
+  }
+
+  mos.start();
+  mos.setVolume(127);
+  mos.setAdsr(0, {0, 0, 0xF, 0});
+
+  SECTION("Waveforms play at the note's frequency") {
+    mos.setPulseWidth(0, 2048);
+    for (auto waveform : {sid::Waveform::Saw, sid::Waveform::Triangle, sid::Waveform::Square}) {
+      mos.setWaveform(0, waveform);
+      mos.playNote(0, 69, 127);
+      emu.render(samples.data(), samples.size());
+      CHECK(countZeroCrossings(samples) >= 2 * 438);
+      CHECK(countZeroCrossings(samples) <= 2 * 442);
+      mos.playNote(0, 69, 0);
+      emu.render(samples.data(), samples.size());
+    }
+  }
+
+  SECTION("Noise is not periodic") {
+    mos.setWaveform(0, sid::Waveform::Noise);
+    mos.playNote(0, 69, 127);
+    emu.render(samples.data(), samples.size());
+    REQUIRE(rms(samples) > 0.05f);
+    REQUIRE(countZeroCrossings(samples) > 2 * 1000);
+  }
+
+  SECTION("Note off releases the envelope") {
+    mos.setWaveform(0, sid::Waveform::Saw);
+    mos.playNote(0, 69, 127);
+    emu.render(samples.data(), samples.size());
+    REQUIRE(rms(samples) > 0.1f);
+    mos.playNote(0, 69, 0);
+    emu.render(samples.data(), samples.size());
+    emu.render(samples.data(), 1000);
+    REQUIRE(std::fabs(samples[999]) < 1e-4f);
+  }
+
+  SECTION("Lowpass filter removes energy") {
+    mos.setWaveform(0, sid::Waveform::Square);
+    mos.setPulseWidth(0, 2048);
+    mos.playNote(0, 81, 127);
+    emu.render(samples.data(), samples.size());
+    const float unfiltered = rms(samples);
+    ctl.writeRegister(0x16, 0x04);
+    ctl.writeRegister(0x18, 0x1F);
+    mos.setFilterIsEnabled(0, true);
+    emu.render(samples.data(), samples.size());
+    REQUIRE(rms(samples) < unfiltered / 2);
+  }
+
+  SECTION("Integer output") {
+    mos.setWaveform(0, sid::Waveform::Square);
+    mos.setPulseWidth(0, 2048);
+    mos.playNote(0, 69, 127);
+    std::vector<int16_t> pcm(4410);
+    emu.render(pcm.data(), pcm.size());
+    REQUIRE(*std::max_element(pcm.begin(), pcm.end()) > 5000);
+    REQUIRE(*std::min_element(pcm.begin(), pcm.end()) < -5000);
+  }
+}
+
+TEST_CASE("Emulator Band-Limited") {
+  // The highest frequency word, the 7th harmonic of the saw lies at 27343 Hz
+  // and folds back to 16757 Hz when point sampled at 44.1 kHz
+  const double fundamental = 0xffff * 1e6 / (1 << 24);
+  const double alias = 44100 - 7 * fundamental;
+  auto renderSaw = [](sid::Emulator& emu, std::vector<float>& samples, const size_t blockSize) {
+    emu.startClock();
+    emu.writeRegister(0x18, 0x0f);
+    emu.writeRegister(0x00, 0xff);
+    emu.writeRegister(0x01, 0xff);
+    emu.writeRegister(0x06, 0xf0);
+    emu.writeRegister(0x04, 0x21);
+    for (size_t i = 0; i < samples.size(); i += blockSize) {
+      emu.render(samples.data() + i, std::min(blockSize, samples.size() - i));
+    }
+  };
+  std::vector<float> samples(44100);
+
+  SECTION("Aliases are suppressed") {
+    const sid::RenderQuality qualities[] = {
+      sid::RenderQuality::PointSampled, sid::RenderQuality::Fast,
+      sid::RenderQuality::Good, sid::RenderQuality::Best
+    };
+    float ratios[4];
+    for (size_t q = 0; q < 4; ++q) {
+      sid::Emulator emu(44100, sid::CLOCK_1MHZ, qualities[q]);
+      renderSaw(emu, samples, samples.size());
+      ratios[q] = goertzel(samples, alias, 44100) / goertzel(samples, fundamental, 44100);
+    }
+    CHECK(ratios[0] > 0.05f);
+    CHECK(ratios[1] < 0.0003f);
+    CHECK(ratios[2] < 0.0003f);
+    CHECK(ratios[3] < 0.0003f);
+  }
+
+  SECTION("Aliases are suppressed across the range") {
+    // Notes from 244 Hz up to the highest the chip plays, as saw, pulse and triangle
+    const uint8_t waveforms[] = {0x20, 0x40, 0x10};
+    std::vector<float> skipped(2048);
+    std::vector<float> tone(16384);
+    for (const auto quality : {sid::RenderQuality::PointSampled, sid::RenderQuality::Fast,
+        sid::RenderQuality::Good, sid::RenderQuality::Best}) {
+      for (const uint8_t waveform : waveforms) {
+        double worst = 0.0;
+        for (uint32_t word = 0x1000; word <= 0xffff; word += 0x1fff) {
+          sid::Emulator emu(44100, sid::CLOCK_1MHZ, quality);
+          emu.startClock();
+          emu.writeRegister(0x18, 0x0f);
+          emu.writeRegister(0x00, word & 0xff);
+          emu.writeRegister(0x01, word >> 8);
+          emu.writeRegister(0x03, 0x06);
+          emu.writeRegister(0x06, 0xf0);
+          emu.writeRegister(0x04, waveform | 0x01);
+          emu.render(skipped.data(), skipped.size());
+          emu.render(tone.data(), tone.size());
+          worst = std::max(worst, inharmonicEnergy(tone, word * 1e6 / (1 << 24), 44100));
+        }
+        INFO("Quality " << int(quality) << ", waveform " << int(waveform)
+          << ", worst " << 10.0 * std::log10(worst) << " dB");
+        if (quality == sid::RenderQuality::PointSampled) {
+          CHECK(worst > (waveform == 0x10 ? 1e-4 : 1e-2));
+        } else {
+          CHECK(worst < 1e-5);
+        }
+      }
+    }
+  }
+
+  SECTION("Pitch is kept") {
+    sid::Emulator emu(48000);
+    renderSaw(emu, samples, samples.size());
+    const float level = goertzel(samples, fundamental, 48000);
+    CHECK(level > 0.1f);
+    CHECK(goertzel(samples, fundamental + 200, 48000) < level / 20);
+  }
+
+  SECTION("Output does not depend on the buffer size") {
+    sid::Emulator whole(44100);
+    sid::Emulator blocks(44100);
+    std::vector<float> other(samples.size());
+    renderSaw(whole, samples, samples.size());
+    renderSaw(blocks, other, 37);
+    REQUIRE(samples == other);
+  }
+}
+
+TEST_CASE("Voice Pool") {
+  Callback startClockCallback;
+  Callback resetCallback;
+  RegisterCallback firstChipCallback;
+  RegisterCallback secondChipCallback;
+  MockController ctls[2] = {
+    MockController(startClockCallback, resetCallback, firstChipCallback),
+    MockController(startClockCallback, resetCallback, secondChipCallback)
+  };
+  uint32_t now = 0;
+  sid::VoicePool<MockController, 2, sid::CLOCK_1MHZ, sid::ManualClock> pool(ctls,
+    sid::VoiceStealing::Oldest, sid::ManualClock(now));
+  pool.start();
+  REQUIRE(startClockCallback.numCalls == 2);
+
+  SECTION("Notes are spread over all voices") {
+    for (uint8_t n = 0; n < 6; ++n) {
+      REQUIRE(pool.noteOn(60 + n, 127) == n);
+    }
+    REQUIRE(firstChipCallback.vec.size() == 9);
+    REQUIRE(secondChipCallback.vec.size() == 9);
+    REQUIRE(secondChipCallback.vec.back().first == 18);
+    REQUIRE(secondChipCallback.vec.back().second == 0b00000001);
+  }
+
+  SECTION("Note off releases the voice of the note") {
+    pool.noteOn(60, 127);
+    pool.noteOn(62, 127);
+    pool.noteOff(62);
+    REQUIRE(firstChipCallback.vec.back().first == 11);
+    REQUIRE(firstChipCallback.vec.back().second == 0b00000000);
+    // Velocity 0 is a note off as well
+    pool.noteOn(60, 0);
+    REQUIRE(firstChipCallback.vec.back().first == 4);
+    REQUIRE(firstChipCallback.vec.back().second == 0b00000000);
+    // Releasing notes keep their voice until it is needed
+    REQUIRE(pool.voiceOf(60) == 0);
+    REQUIRE(pool.voiceOf(64) == sid::NO_VOICE);
+  }
+
+  SECTION("Released voices are reused longest released first") {
+    for (uint8_t n = 0; n < 6; ++n) {
+      pool.noteOn(60 + n, 127);
+    }
+    pool.noteOff(64);
+    pool.noteOff(61);
+    REQUIRE(pool.noteOn(70, 127) == 4);
+    REQUIRE(pool.noteOn(71, 127) == 1);
+    REQUIRE(pool.voiceOf(64) == sid::NO_VOICE);
+    REQUIRE(pool.voiceOf(70) == 4);
+  }
+
+  SECTION("Oldest voice is stolen") {
+    for (uint8_t n = 0; n < 6; ++n) {
+      pool.noteOn(60 + n, 127);
+    }
+    firstChipCallback.vec.clear();
+    REQUIRE(pool.noteOn(70, 127) == 0);
+    REQUIRE(pool.voiceOf(60) == sid::NO_VOICE);
+    // Gate off and on again so that the envelope restarts
+    REQUIRE(firstChipCallback.vec.front().first == 4);
+    REQUIRE(firstChipCallback.vec.front().second == 0b00000000);
+    REQUIRE(firstChipCallback.vec.back().first == 4);
+    REQUIRE(firstChipCallback.vec.back().second == 0b00000001);
+    REQUIRE(pool.noteOn(71, 127) == 1);
+  }
+
+  SECTION("Quietest voice is stolen") {
+    pool.setStealing(sid::VoiceStealing::Quietest);
+    pool.setAdsr({0, 0, 0xF, 0});
+    pool.setAdsr(4, {0, 0, 0x3, 0});
+    pool.setAdsr(2, {0, 0, 0x8, 0});
+    for (uint8_t n = 0; n < 6; ++n) {
+      pool.noteOn(60 + n, 127);
+    }
+    now += 100000;
+    REQUIRE(pool.noteOn(70, 127) == 4);
+    // Voice 4 is attacking again, so the next quietest sustaining voice goes
+    REQUIRE(pool.noteOn(71, 127) == 2);
+    now += 100000;
+    REQUIRE(pool.noteOn(72, 127) == 4);
+    pool.setAdsr(4, {0, 0, 0xF, 0});
+    now += 100000;
+    REQUIRE(pool.noteOn(73, 127) == 2);
+  }
+
+  SECTION("Quietest steals by envelope phase before level") {
+    pool.setStealing(sid::VoiceStealing::Quietest);
+    pool.setAdsr({0, 0, 0xF, 0});
+    // Attacks for 500 ms towards a sustain level of 0
+    pool.setAdsr(0, {0xA, 0, 0, 0});
+    // Decays for 1.5 s
+    pool.setAdsr(1, {0, 0xA, 0, 0});
+    for (uint8_t n = 0; n < 6; ++n) {
+      pool.noteOn(60 + n, 127);
+    }
+    now += 100000;
+    // Sustaining voices go first even at full level, oldest first
+    for (uint8_t v = 2; v < 6; ++v) {
+      REQUIRE(pool.noteOn(70 + v, 127) == v);
+    }
+    // Then the decaying one, while the attacking one is kept
+    REQUIRE(pool.noteOn(80, 127) == 1);
+    REQUIRE(pool.voiceOf(60) == 0);
+    // Among attacking voices the one furthest from its peak goes
+    REQUIRE(pool.noteOn(81, 127) == 0);
+    // Among decaying voices the one closest to its sustain level goes,
+    // voice 1 now decays for 1.5 s and the others for 6 ms
+    now += 3000;
+    REQUIRE(pool.noteOn(82, 127) == 2);
+  }
+
+  SECTION("Same note restarts on its voice") {
+    pool.setStealing(sid::VoiceStealing::SameNote);
+    pool.noteOn(60, 127);
+    pool.noteOn(62, 127);
+    firstChipCallback.vec.clear();
+    REQUIRE(pool.noteOn(60, 127) == 0);
+    REQUIRE(firstChipCallback.vec.size() == 2);
+    REQUIRE(firstChipCallback.vec.front().second == 0b00000000);
+    REQUIRE(firstChipCallback.vec.back().second == 0b00000001);
+    pool.noteOff(62);
+    REQUIRE(pool.noteOn(62, 127) == 1);
+  }
+
+  SECTION("Same note takes a new voice without restarting") {
+    pool.noteOn(60, 127);
+    REQUIRE(pool.noteOn(60, 127) == 1);
+    REQUIRE(pool.voiceOf(60) == 1);
+    pool.allNotesOff();
+    REQUIRE(firstChipCallback.vec.back().first == 11);
+    REQUIRE(firstChipCallback.vec.back().second == 0b00000000);
+  }
+}
+
+struct BurstController : MockController {
+  BurstController(Callback& clockFn, Callback& resetFn, RegisterCallback& registerFn,
+      std::vector<uint8_t>& burstSizes)
+    : MockController(clockFn, resetFn, registerFn)
+    , bursts(burstSizes) {
+  }
+
+  void writeRegisters(const uint8_t* addresses, const uint8_t* data, const uint8_t count) {
+    bursts.push_back(count);
+    for (uint8_t i = 0; i < count; ++i) {
+      writeRegister(addresses[i], data[i]);
+    }
+  }
+
+  std::vector<uint8_t>& bursts;
+};
+
+TEST_CASE("Mos8561 Transactions") {
+  Callback startClockCallback;
+  Callback resetCallback;
+  RegisterCallback writeRegisterCallback;
+  std::vector<uint8_t> bursts;
+  sid::Adsr adsr = {0x8, 0x3, 0xF, 0x4};
+
+  SECTION("Writes are sent on commit") {
+    MockController ctl(startClockCallback, resetCallback, writeRegisterCallback);
+    sid::Mos8561<MockController> mos(ctl);
+    mos.begin();
+    mos.setAdsr(0, adsr);
+    mos.setPulseWidth(0, 1234);
+    REQUIRE(writeRegisterCallback.vec.size() == 0);
+    mos.commit();
+    REQUIRE(writeRegisterCallback.vec.size() == 4);
+    REQUIRE(writeRegisterCallback.vec.at(0).first == 5);
+    REQUIRE(writeRegisterCallback.vec.at(3).first == 3);
+    REQUIRE(writeRegisterCallback.vec.at(3).second == 0b100);
+  }
+
+  SECTION("Controllers with burst support get one call") {
+    BurstController ctl(startClockCallback, resetCallback, writeRegisterCallback, bursts);
+    sid::Mos8561<BurstController> mos(ctl);
+    {
+      sid::Mos8561<BurstController>::Transaction transaction(mos);
+      mos.setAdsr(0, adsr);
+      mos.setAdsr(1, adsr);
+      // Nested transactions are sent with the outermost one
+      mos.begin();
+      mos.setAdsr(2, adsr);
+      mos.commit();
+      REQUIRE(writeRegisterCallback.vec.size() == 0);
+    }
+    REQUIRE(bursts.size() == 1);
+    REQUIRE(bursts.front() == 6);
+    REQUIRE(writeRegisterCallback.vec.size() == 6);
+    REQUIRE(writeRegisterCallback.vec.back().first == 20);
+  }
+
+  SECTION("Gate changes are kept in order") {
+    MockController ctl(startClockCallback, resetCallback, writeRegisterCallback);
+    sid::Mos8561<MockController> mos(ctl);
+    mos.start();
+    mos.setWaveform(0, sid::Waveform::Saw);
+    mos.playNote(0, 60, 127);
+    writeRegisterCallback.vec.clear();
+    mos.begin();
+    mos.playNote(0, 60, 0);
+    mos.playNote(0, 60, 127);
+    mos.commit();
+    REQUIRE(writeRegisterCallback.vec.size() == 2);
+    REQUIRE(writeRegisterCallback.vec.front().second == 0b00100000);
+    REQUIRE(writeRegisterCallback.vec.back().second == 0b00100001);
+  }
+
+  SECTION("Full queues are flushed early") {
+    BurstController ctl(startClockCallback, resetCallback, writeRegisterCallback, bursts);
+    sid::Mos8561<BurstController> mos(ctl);
+    mos.begin();
+    for (uint16_t width = 0; width < MOS8561_TRANSACTION_SIZE; ++width) {
+      mos.setPulseWidth(0, width);
+    }
+    mos.commit();
+    // Two writes for the first width, after that only the lower byte changes
+    REQUIRE(writeRegisterCallback.vec.size() == MOS8561_TRANSACTION_SIZE + 1);
+    REQUIRE(bursts.size() == 2);
+    REQUIRE(bursts.front() == MOS8561_TRANSACTION_SIZE);
+    REQUIRE(bursts.back() == 1);
+  }
+
+  SECTION("Start drops the writes queued before the reset") {
+    MockController ctl(startClockCallback, resetCallback, writeRegisterCallback);
+    sid::Mos8561<MockController> mos(ctl);
+    mos.begin();
+    mos.setAdsr(0, adsr);
+    mos.start();
+    mos.setPulseWidth(0, 1234);
+    mos.commit();
+    REQUIRE(writeRegisterCallback.vec.size() == 2);
+    REQUIRE(writeRegisterCallback.vec.at(0).first == 2);
+    REQUIRE(writeRegisterCallback.vec.at(1).first == 3);
+    // The chip was cleared, so the envelope is sent again
+    mos.setAdsr(0, adsr);
+    REQUIRE(writeRegisterCallback.vec.size() == 4);
+    REQUIRE(writeRegisterCallback.vec.at(2).first == 5);
+    REQUIRE(writeRegisterCallback.vec.at(3).first == 6);
+  }
+
+  SECTION("Invalidate keeps the queued writes") {
+    MockController ctl(startClockCallback, resetCallback, writeRegisterCallback);
+    sid::Mos8561<MockController> mos(ctl);
+    mos.start();
+    mos.begin();
+    mos.setAdsr(0, adsr);
+    mos.invalidate();
+    mos.commit();
+    REQUIRE(writeRegisterCallback.vec.size() == 2);
+    // Nothing is known about the chip, so the same envelope is sent again
+    mos.setAdsr(0, adsr);
+    REQUIRE(writeRegisterCallback.vec.size() == 4);
+  }
+}
+
+TEST_CASE("Scheduler") {
+  Callback startClockCallback;
+  Callback resetCallback;
+  RegisterCallback writeRegisterCallback;
+  MockController ctl(startClockCallback, resetCallback, writeRegisterCallback);
+  typedef sid::Mos8561<MockController> Synth;
+  Synth mos(ctl);
+  mos.start();
+  sid::Scheduler<Synth, 4> scheduler(mos);
+
+  SECTION("Events are played when they are due") {
+    REQUIRE(scheduler.post(sid::Event::setWaveform(10, 0, sid::Waveform::Saw)));
+    REQUIRE(scheduler.post(sid::Event::noteOn(10, 0, 57, 127)));
+    REQUIRE(scheduler.post(sid::Event::noteOff(20, 0, 57)));
+    REQUIRE(scheduler.tick(9) == 0);
+    REQUIRE(writeRegisterCallback.vec.size() == 0);
+    REQUIRE(scheduler.tick(15) == 2);
+    REQUIRE(writeRegisterCallback.vec.size() == 4);
+    REQUIRE(writeRegisterCallback.vec.back().first == 4);
+    REQUIRE(writeRegisterCallback.vec.back().second == 0b00100001);
+    REQUIRE(scheduler.tick(20) == 1);
+    REQUIRE(writeRegisterCallback.vec.back().second == 0b00100000);
+    REQUIRE(scheduler.isIdle());
+  }
+
+  SECTION("Parameter changes") {
+    scheduler.post(sid::Event::setAdsr(0, 1, {0xA, 0x4, 0x0, 0x5}));
+    scheduler.post(sid::Event::pulseWidth(0, 2, 3456));
+    scheduler.post(sid::Event::setVolume(0, 127));
+    scheduler.post(sid::Event::setFilter(0, 2, true));
+    REQUIRE(scheduler.tick(0) == 4);
+    REQUIRE(writeRegisterCallback.vec.size() == 6);
+    REQUIRE(writeRegisterCallback.vec.at(0).first == 12);
+    REQUIRE(writeRegisterCallback.vec.at(3).first == 17);
+    REQUIRE(writeRegisterCallback.vec.at(4).first == 24);
+    REQUIRE(writeRegisterCallback.vec.at(5).second == 0b00000100);
+  }
+
+  SECTION("Full queue rejects events") {
+    for (uint32_t t = 0; t < 4; ++t) {
+      REQUIRE(scheduler.post(sid::Event::pitchBend(t, 0, t)));
+    }
+    REQUIRE_FALSE(scheduler.post(sid::Event::pitchBend(4, 0, 4)));
+    REQUIRE(scheduler.tick(0) == 1);
+    REQUIRE(scheduler.post(sid::Event::pitchBend(4, 0, 4)));
+  }
+
+  SECTION("Time wraps around") {
+    scheduler.post(sid::Event::setVolume(0xfffffff0, 127));
+    scheduler.post(sid::Event::setVolume(0x10, 0));
+    REQUIRE(scheduler.tick(0xffffffff) == 1);
+    REQUIRE(scheduler.tick(0x0f) == 0);
+    REQUIRE(scheduler.tick(0x10) == 1);
+  }
+
+  SECTION("Producer and consumer threads") {
+    const uint32_t numEvents = 20000;
+    std::thread producer([&scheduler]() {
+      for (uint32_t i = 0; i < numEvents; ++i) {
+        while (!scheduler.post(sid::Event::pulseWidth(i, 0, i & 0xff))) {
+          std::this_thread::yield();
+        }
+      }
+    });
+    uint32_t numPlayed = 0;
+    while (numPlayed < numEvents) {
+      const uint32_t played = scheduler.tick(numEvents);
+      if (played == 0) {
+        std::this_thread::yield();
+      }
+      numPlayed += played;
+    }
+    producer.join();
+    // Every event changes the lower byte, so every one of them is written in order
+    std::vector<uint8_t> lowerBytes;
+    for (const auto& write : writeRegisterCallback.vec) {
+      if (write.first == 2) {
+        lowerBytes.push_back(write.second);
+      }
+    }
+    std::vector<uint8_t> expected;
+    for (uint32_t i = 1; i < numEvents; ++i) {
+      expected.push_back(i & 0xff);
+    }
+    REQUIRE(lowerBytes == expected);
+  }
+}
+
+TEST_CASE("Modulation") {
+  Callback startClockCallback;
+  Callback resetCallback;
+  RegisterCallback writeRegisterCallback;
+  MockController ctl(startClockCallback, resetCallback, writeRegisterCallback);
+  typedef sid::Mos8561<MockController> Synth;
+  Synth mos(ctl);
+  mos.start();
+  mos.setWaveform(0, sid::Waveform::Square);
+  mos.playNote(0, 69, 127);
+  writeRegisterCallback.vec.clear();
+  sid::ModulationEngine<Synth> engine(mos);
+
+  SECTION("LFO shapes") {
+    sid::Lfo lfo;
+    lfo.rate = 0x4000;
+    REQUIRE(lfo.next() == 0);
+    REQUIRE(lfo.next() == 127);
+    REQUIRE(lfo.next() == -1);
+    REQUIRE(lfo.next() == -128);
+    lfo.shape = sid::LfoShape::Saw;
+    REQUIRE(lfo.next() == -64);
+    lfo.shape = sid::LfoShape::Square;
+    lfo.phase = 0;
+    REQUIRE(lfo.next() == 127);
+    REQUIRE(lfo.next() == -128);
+    REQUIRE(sid::lfoRate(5.f, 1000) == 328);
+  }
+
+  SECTION("Nothing is written without modulation") {
+    for (int i = 0; i < 100; ++i) {
+      engine.tick();
+    }
+    REQUIRE(writeRegisterCallback.vec.size() == 0);
+  }
+
+  SECTION("Vibrato mostly changes the lower frequency byte") {
+    engine.setVibrato(0, sid::LfoShape::Triangle, sid::lfoRate(5.f, 1000), 64);
+    for (int i = 0; i < 1000; ++i) {
+      engine.tick();
+    }
+    size_t lowerWrites = 0;
+    size_t otherWrites = 0;
+    for (const auto& write : writeRegisterCallback.vec) {
+      lowerWrites += write.first == 0;
+      otherWrites += write.first > 1;
+    }
+    REQUIRE(otherWrites == 0);
+    REQUIRE(lowerWrites > 100);
+    REQUIRE(writeRegisterCallback.vec.size() < lowerWrites * 11 / 10);
+  }
+
+  SECTION("Pulse width sweep stays in range") {
+    engine.setPulseWidthModulation(0, sid::LfoShape::Saw, sid::lfoRate(50.f, 1000), 4000, 1024);
+    for (int i = 0; i < 20; ++i) {
+      engine.tick();
+    }
+    // The upper half of the sweep is clamped to the maximum width
+    REQUIRE(writeRegisterCallback.vec.size() > 10);
+    REQUIRE(writeRegisterCallback.vec.at(0).first == 2);
+    uint8_t upper = 0;
+    for (const auto& write : writeRegisterCallback.vec) {
+      upper = write.first == 3 ? std::max(upper, write.second) : upper;
+    }
+    REQUIRE(upper == 0xf);
+  }
+
+  SECTION("Envelope follows the gate") {
+    engine.setEnvelope(0, sid::envelopeRate(0.01f, 1000), sid::envelopeRate(0.f, 1000), 0, 2048);
+    engine.gate(0, true);
+    for (int i = 0; i < 10; ++i) {
+      engine.tick();
+    }
+    REQUIRE(writeRegisterCallback.vec.back().first == 2);
+    REQUIRE(writeRegisterCallback.vec.back().second == 0xf8);
+    engine.tick();
+    REQUIRE(writeRegisterCallback.vec.back().second == 0xf8);
+    engine.gate(0, false);
+    engine.tick();
+    REQUIRE(writeRegisterCallback.vec.back().first == 3);
+    REQUIRE(writeRegisterCallback.vec.back().second == 0x08);
+  }
+}
+
+TEST_CASE("Mos8561 Compile-Time Voices") {
+  Callback startClockCallback;
+  Callback resetCallback;
+  RegisterCallback writeRegisterCallback;
+  MockController ctl(startClockCallback, resetCallback, writeRegisterCallback);
+  sid::Mos8561<MockController> mos(ctl);
+
+  static_assert(sid::VoiceRegisters<0>::FREQ_LO == 0, "");
+  static_assert(sid::VoiceRegisters<1>::CONTROL == 11, "");
+  static_assert(sid::VoiceRegisters<2>::SUSTAIN_RELEASE == 20, "");
+  static_assert(sid::VoiceRegisters<2>::FILTER_MASK == 0b100, "");
+  static_assert(sid::VoiceRegisters<1>::FREQ_LO == 7, "");
+  static_assert(sid::VoiceRegisters<1>::FREQ_HI == 8, "");
+  static_assert(sid::VoiceRegisters<1>::PW_LO == 9, "");
+  static_assert(sid::VoiceRegisters<1>::PW_HI == 10, "");
+  static_assert(sid::VoiceRegisters<1>::ATTACK_DECAY == 12, "");
+  static_assert(sid::VoiceRegisters<1>::SUSTAIN_RELEASE == 13, "");
+  static_assert(sid::VoiceRegisters<2>::FREQ_LO == 14, "");
+  static_assert(sid::VoiceRegisters<2>::FREQ_HI == 15, "");
+  static_assert(sid::VoiceRegisters<2>::PW_LO == 16, "");
+  static_assert(sid::VoiceRegisters<2>::PW_HI == 17, "");
+  static_assert(sid::VoiceRegisters<2>::CONTROL == 18, "");
+  static_assert(sid::VoiceRegisters<2>::ATTACK_DECAY == 19, "");
+
+  SECTION("Set ADSR for third Voice") {
+    mos.setAdsr<2>({0x2, 0x0, 0x1, 0xB});
+    REQUIRE(writeRegisterCallback.vec.size() == 2);
+    REQUIRE(writeRegisterCallback.vec.front().first == 19);
+    REQUIRE(writeRegisterCallback.vec.front().second == 0b00100000);
+    REQUIRE(writeRegisterCallback.vec.back().first == 20);
+    REQUIRE(writeRegisterCallback.vec.back().second == 0b00011011);
+  }
+
+  SECTION("Set Pulse Width for second Voice") {
+    mos.setPulseWidth<1>(1234);
+    mos.setPulseWidth<1, 1235>();
+    REQUIRE(writeRegisterCallback.vec.size() == 3);
+    REQUIRE(writeRegisterCallback.vec.at(0).first == 9);
+    REQUIRE(writeRegisterCallback.vec.at(1).first == 10);
+    REQUIRE(writeRegisterCallback.vec.at(1).second == 0b100);
+    REQUIRE(writeRegisterCallback.vec.at(2).first == 9);
+    REQUIRE(writeRegisterCallback.vec.at(2).second == 0b11010011);
+  }
+
+  SECTION("Play Note On and Off with third Voice") {
+    mos.setWaveform<2>(sid::Waveform::Saw);
+    mos.playNote<2>(14, 127);
+    mos.setPitchBend<2>(0);
+    mos.playPitch<2>(14 * 256, 0);
+    REQUIRE(writeRegisterCallback.vec.size() == 5);
+    REQUIRE(writeRegisterCallback.vec.at(1).first == 14);
+    REQUIRE(writeRegisterCallback.vec.at(1).second == 0x34);
+    REQUIRE(writeRegisterCallback.vec.at(3).first == 18);
+    REQUIRE(writeRegisterCallback.vec.at(3).second == 0b00100001);
+    REQUIRE(writeRegisterCallback.vec.at(4).second == 0b00100000);
+  }
+
+  SECTION("Both flavours write the same registers") {
+    RegisterCallback runtimeCallback;
+    sid::Mos8561<MockController> runtimeMos(
+      MockController(startClockCallback, resetCallback, runtimeCallback));
+    mos.start();
+    runtimeMos.start();
+    mos.setAdsr<1>({0x2, 0x3, 0x4, 0x5});
+    runtimeMos.setAdsr(1, {0x2, 0x3, 0x4, 0x5});
+    mos.setWaveform<1>(sid::Waveform::Square);
+    runtimeMos.setWaveform(1, sid::Waveform::Square);
+    mos.setPulseWidth<1>(0x321);
+    runtimeMos.setPulseWidth(1, 0x321);
+    mos.setSync<1>(true);
+    runtimeMos.setSync(1, true);
+    mos.playNote<1>(60, 127);
+    runtimeMos.playNote(1, 60, 127);
+    mos.setPitchBend<1>(100);
+    runtimeMos.setPitchBend(1, 100);
+    const sid::Patch bank[] = {{0x11, 0x67, 0x89, 0x10, 0x02}};
+    mos.setPatchBank(bank);
+    runtimeMos.setPatchBank(bank);
+    mos.applyPatch<1>(0);
+    runtimeMos.applyPatch(1, 0);
+    REQUIRE(writeRegisterCallback.vec.size() == 16);
+    REQUIRE(writeRegisterCallback.vec == runtimeCallback.vec);
+  }
+
+  SECTION("Enable Filter") {
+    mos.setFilterIsEnabled<1>(true);
+    mos.setFilterIsEnabled<2>(true);
+    REQUIRE(writeRegisterCallback.vec.back().first == 23);
+    REQUIRE(writeRegisterCallback.vec.back().second == 0b00000110);
+  }
+}
+
+TEST_CASE("MIDI Input") {
+  Callback startClockCallback;
+  Callback resetCallback;
+  RegisterCallback writeRegisterCallback;
+  MockController ctl(startClockCallback, resetCallback, writeRegisterCallback);
+  typedef sid::Mos8561<MockController> Synth;
+  Synth mos(ctl);
+  mos.start();
+  mos.setWaveform(0, sid::Waveform::Square);
+  mos.setWaveform(1, sid::Waveform::Square);
+  writeRegisterCallback.vec.clear();
+  sid::MidiInput<Synth> midi(mos);
+
+  SECTION("Note on and off") {
+    const uint8_t bytes[] = {0x90, 57, 100, 0x80, 57, 0};
+    midi.parse(bytes, 3);
+    REQUIRE(writeRegisterCallback.vec.size() == 3);
+    REQUIRE(writeRegisterCallback.vec.at(0).second == 0x6B);
+    REQUIRE(writeRegisterCallback.vec.at(2).second == 0b01000001);
+    midi.parse(bytes + 3, 3);
+    REQUIRE(writeRegisterCallback.vec.back().second == 0b01000000);
+    REQUIRE(midi.numMessages() == 2);
+  }
+
+  SECTION("Running status and velocity 0") {
+    const uint8_t bytes[] = {0x91, 48, 100, 57, 0, 48, 0};
+    midi.parse(bytes, sizeof(bytes));
+    // The note off for 57 does not release 48
+    REQUIRE(writeRegisterCallback.vec.size() == 4);
+    REQUIRE(writeRegisterCallback.vec.back().first == 11);
+    REQUIRE(writeRegisterCallback.vec.back().second == 0b01000000);
+    REQUIRE(midi.numMessages() == 3);
+  }
+
+  SECTION("Realtime messages inside a message") {
+    const uint8_t bytes[] = {0x90, 0xf8, 57, 0xfe, 100};
+    midi.parse(bytes, sizeof(bytes));
+    REQUIRE(midi.numMessages() == 1);
+    REQUIRE(writeRegisterCallback.vec.back().second == 0b01000001);
+  }
+
+  SECTION("System exclusive is skipped") {
+    const uint8_t bytes[] = {0x90, 57, 100, 0xf0, 0x43, 0x12, 0x00, 0xf7, 60, 100, 0x90, 60, 100};
+    midi.parse(bytes, sizeof(bytes));
+    // Data after the end of system exclusive has no running status
+    REQUIRE(midi.numMessages() == 2);
+  }
+
+  SECTION("System common cancels running status") {
+    const uint8_t bytes[] = {0x90, 57, 100, 0xf2, 0x10, 0x20, 60, 100, 0xf6, 62, 100};
+    midi.parse(bytes, sizeof(bytes));
+    REQUIRE(midi.numMessages() == 1);
+  }
+
+  SECTION("Channels outside the voices are ignored") {
+    sid::MidiInput<Synth> shifted(mos, 4);
+    const uint8_t bytes[] = {0x93, 57, 100, 0x97, 57, 100, 0x94, 57, 100};
+    shifted.parse(bytes, sizeof(bytes));
+    REQUIRE(shifted.numMessages() == 1);
+    REQUIRE(writeRegisterCallback.vec.back().first == 4);
+  }
+
+  SECTION("Pitch bend") {
+    const uint8_t bytes[] = {0x90, 69, 100, 0xe0, 0x00, 0x50};
+    midi.parse(bytes, sizeof(bytes));
+    // 0x2800 is a quarter up, i.e. half a semitone with a range of 2
+    REQUIRE(writeRegisterCallback.vec.at(3).first == 0);
+    REQUIRE(writeRegisterCallback.vec.at(3).second == (7601 & 0xff));
+  }
+
+  SECTION("Control changes") {
+    const uint8_t bytes[] = {0xb0, 7, 127, 73, 127, 79, 64, 70, 64, 80, 127};
+    midi.parse(bytes, sizeof(bytes));
+    REQUIRE(writeRegisterCallback.vec.at(0).first == 24);
+    REQUIRE(writeRegisterCallback.vec.at(0).second == 0x0f);
+    REQUIRE(writeRegisterCallback.vec.at(1).first == 5);
+    REQUIRE(writeRegisterCallback.vec.at(1).second == 0xf0);
+    REQUIRE(writeRegisterCallback.vec.at(2).first == 6);
+    REQUIRE(writeRegisterCallback.vec.at(2).second == 0x80);
+    REQUIRE(mos.adsr(0).att == 0xf);
+    REQUIRE(mos.adsr(0).sus == 0x8);
+    REQUIRE(writeRegisterCallback.vec.at(3).first == 3);
+    REQUIRE(writeRegisterCallback.vec.at(3).second == 0x08);
+    REQUIRE(writeRegisterCallback.vec.back().first == 23);
+    REQUIRE(writeRegisterCallback.vec.back().second == 0b001);
+  }
+
+  SECTION("Program change selects the waveform") {
+    const uint8_t bytes[] = {0xc1, 1, 3};
+    midi.parse(bytes, sizeof(bytes));
+    REQUIRE(writeRegisterCallback.vec.size() == 2);
+    REQUIRE(writeRegisterCallback.vec.at(0).second == 0b00100000);
+    REQUIRE(writeRegisterCallback.vec.at(1).second == 0b10000000);
+  }
+}
+
+struct VectorSink {
+  void put(uint8_t byte) {
+    bytes.push_back(byte);
+  }
+  std::vector<uint8_t> bytes;
+};
+
+TEST_CASE("Trace") {
+  Callback startClockCallback;
+  Callback resetCallback;
+  RegisterCallback writeRegisterCallback;
+  MockController ctl(startClockCallback, resetCallback, writeRegisterCallback);
+  uint32_t now = 1000;
+  VectorSink sink;
+  typedef sid::TraceWriter<VectorSink, sid::ManualClock> Writer;
+  typedef sid::RecordingController<MockController, Writer> Recorder;
+  Writer writer(sink, sid::ManualClock(now));
+  sid::Mos8561<Recorder> mos(Recorder(ctl, writer));
+
+  SECTION("Encoding") {
+    mos.start();
+    now += 3;
+    mos.setVolume(127);
+    now += 200;
+    mos.setVolume(0);
+    const std::vector<uint8_t> expected = {
+      'S', 'I', 'D', 'T', 1, 0x40, 0x42, 0x0f, 0x00,
+      // startClock and reset in the same tick
+      0x1e, 0x1f,
+      // Delta of 3 fits in the tag
+      0x60 | 24, 15,
+      // Delta of 200 is 7 + 193 as a varint
+      0xe0 | 24, 0xc1, 0x01, 0
+    };
+    REQUIRE(sink.bytes == expected);
+    REQUIRE(writeRegisterCallback.vec.size() == 2);
+    REQUIRE(startClockCallback.numCalls == 1);
+  }
+
+  SECTION("Round Trip") {
+    mos.start();
+    for (int i = 0; i < 16; ++i) {
+      now += i * 37;
+      mos.playNote(i % 3, 40 + i, 100);
+      mos.setPulseWidth(i % 3, i * 200);
+    }
+    const std::vector<std::pair<uint8_t, uint8_t>> recorded = writeRegisterCallback.vec;
+    writeRegisterCallback.vec.clear();
+
+    sid::MemoryBytes bytes = {sink.bytes.data(), sink.bytes.size()};
+    sid::TraceReader<sid::MemoryBytes> reader(bytes);
+    REQUIRE(reader.isValid());
+    REQUIRE(reader.ticksPerSecond() == 1000000);
+
+    sid::TraceReplayer<MockController, sid::MemoryBytes> replayer(ctl, bytes);
+    replayer.playAll();
+    REQUIRE(writeRegisterCallback.vec == recorded);
+    REQUIRE(startClockCallback.numCalls == 2);
+    REQUIRE(resetCallback.numCalls == 2);
+  }
+
+  SECTION("Timing") {
+    mos.start();
+    now += 10;
+    mos.setVolume(127);
+    now += 1000;
+    mos.setVolume(0);
+    writeRegisterCallback.vec.clear();
+
+    sid::TraceReplayer<MockController, sid::FlashBytes> replayer(ctl,
+      sid::FlashBytes{sink.bytes.data(), sink.bytes.size()});
+    const uint32_t origin = 0xfffffff0;
+    replayer.start(origin);
+    REQUIRE(replayer.poll(origin));
+    REQUIRE(startClockCallback.numCalls == 2);
+    REQUIRE(writeRegisterCallback.vec.size() == 0);
+    REQUIRE(replayer.poll(origin + 9));
+    REQUIRE(writeRegisterCallback.vec.size() == 0);
+    REQUIRE(replayer.poll(origin + 10));
+    REQUIRE(writeRegisterCallback.vec.size() == 1);
+    REQUIRE(replayer.poll(origin + 1009));
+    REQUIRE(writeRegisterCallback.vec.size() == 1);
+    REQUIRE_FALSE(replayer.poll(origin + 1010));
+    REQUIRE(writeRegisterCallback.vec.size() == 2);
+  }
+
+  SECTION("Truncated") {
+    mos.start();
+    now += 500;
+    mos.setVolume(127);
+    sid::TraceRecord record;
+    sid::TraceReader<sid::MemoryBytes> reader(
+      sid::MemoryBytes{sink.bytes.data(), sink.bytes.size() - 2});
+    REQUIRE(reader.next(record));
+    REQUIRE(reader.next(record));
+    REQUIRE_FALSE(reader.next(record));
+    REQUIRE_FALSE(sid::TraceReader<sid::MemoryBytes>(sid::MemoryBytes{sink.bytes.data(), 4}).isValid());
+  }
+
+  SECTION("Zero Tick Rate") {
+    mos.start();
+    REQUIRE(sid::TraceReader<sid::MemoryBytes>(
+      sid::MemoryBytes{sink.bytes.data(), sink.bytes.size()}).isValid());
+    for (size_t i = 5; i < sid::TRACE_HEADER_SIZE; ++i) {
+      sink.bytes[i] = 0;
+    }
+    REQUIRE_FALSE(sid::TraceReader<sid::MemoryBytes>(
+      sid::MemoryBytes{sink.bytes.data(), sink.bytes.size()}).isValid());
+  }
+
+  SECTION("Mapped File") {
+    mos.start();
+    mos.playNote(0, 60, 100);
+    char path[] = "/tmp/tst_mos8561_XXXXXX";
+    const int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    REQUIRE(write(fd, sink.bytes.data(), sink.bytes.size()) == (ssize_t)sink.bytes.size());
+    close(fd);
+    const std::vector<std::pair<uint8_t, uint8_t>> recorded = writeRegisterCallback.vec;
+    writeRegisterCallback.vec.clear();
+    {
+      sid::MappedTrace file(path);
+      REQUIRE(file.bytes().size == sink.bytes.size());
+      sid::TraceReplayer<MockController, sid::MemoryBytes> replayer(ctl, file.bytes());
+      replayer.playAll();
+    }
+    std::remove(path);
+    REQUIRE(writeRegisterCallback.vec == recorded);
+    REQUIRE(sid::MappedTrace("/nonexistent/trace").bytes().size == 0);
+  }
+}
+
+namespace {
+  const sid::Patch PATCH_BANK[] MOS8561_PROGMEM = {
+    sid::makePatch(sid::Waveform::Saw, {0x1, 0x8, 0xA, 0x4}, 0, false),
+    sid::makePatch(sid::Waveform::Square, {0x1, 0x8, 0xA, 0x4}, 0x800, false),
+    sid::makePatch(sid::Waveform::Square, {0x2, 0x8, 0xA, 0x4}, 0x800, true)
+  };
+}
+
+TEST_CASE("Patch Bank") {
+  Callback startClockCallback;
+  Callback resetCallback;
+  RegisterCallback writeRegisterCallback;
+  std::vector<uint8_t> bursts;
+  BurstController ctl(startClockCallback, resetCallback, writeRegisterCallback, bursts);
+  sid::Mos8561<BurstController> mos(ctl);
+  mos.start();
+  mos.setPatchBank(PATCH_BANK, true);
+  REQUIRE(mos.patchCount() == 3);
+
+  SECTION("Packing") {
+    const sid::Patch patch = sid::makePatch(sid::Waveform::Noise, {0x1, 0x2, 0x3, 0x4}, 0xABC, true);
+    REQUIRE(sizeof(sid::Patch) == 5);
+    REQUIRE(patch.waveformFilter == 0x81);
+    REQUIRE(patch.attackDecay == 0x12);
+    REQUIRE(patch.sustainRelease == 0x34);
+    REQUIRE(patch.pulseWidthLo == 0xBC);
+    REQUIRE(patch.pulseWidthHi == 0x0A);
+  }
+
+  SECTION("Apply writes the patch in one burst") {
+    mos.applyPatch(1, 0);
+    REQUIRE(bursts.size() == 1);
+    REQUIRE(writeRegisterCallback.vec.size() == 3);
+    REQUIRE(writeRegisterCallback.vec.at(0) == std::make_pair<uint8_t, uint8_t>(11, 0x20));
+    REQUIRE(writeRegisterCallback.vec.at(1) == std::make_pair<uint8_t, uint8_t>(12, 0x18));
+    REQUIRE(writeRegisterCallback.vec.at(2) == std::make_pair<uint8_t, uint8_t>(13, 0xA4));
+    REQUIRE(mos.adsr(1).att == 0x1);
+    REQUIRE(mos.adsr(1).rel == 0x4);
+  }
+
+  SECTION("Only differences are written") {
+    mos.applyPatch(0, 0);
+    writeRegisterCallback.vec.clear();
+    mos.applyPatch(0, 0);
+    REQUIRE(writeRegisterCallback.vec.size() == 0);
+
+    mos.applyPatch(0, 1);
+    REQUIRE(writeRegisterCallback.vec.size() == 2);
+    REQUIRE(writeRegisterCallback.vec.at(0) == std::make_pair<uint8_t, uint8_t>(4, 0x40));
+    REQUIRE(writeRegisterCallback.vec.at(1) == std::make_pair<uint8_t, uint8_t>(3, 0x08));
+    writeRegisterCallback.vec.clear();
+
+    mos.applyPatch<0>(2);
+    REQUIRE(writeRegisterCallback.vec.size() == 2);
+    REQUIRE(writeRegisterCallback.vec.at(0) == std::make_pair<uint8_t, uint8_t>(5, 0x28));
+    REQUIRE(writeRegisterCallback.vec.at(1) == std::make_pair<uint8_t, uint8_t>(23, 0x01));
+  }
+
+  SECTION("The playing note is kept") {
+    mos.applyPatch(0, 0);
+    mos.playNote(0, 60, 127);
+    writeRegisterCallback.vec.clear();
+    mos.applyPatch(0, 1);
+    REQUIRE(writeRegisterCallback.vec.at(0) == std::make_pair<uint8_t, uint8_t>(4, 0x41));
+  }
+
+  SECTION("A patch is written again after start") {
+    mos.applyPatch(0, 2);
+    const auto applied = writeRegisterCallback.vec;
+    REQUIRE(applied.size() == 5);
+    mos.start();
+    writeRegisterCallback.vec.clear();
+    mos.applyPatch(0, 2);
+    REQUIRE(writeRegisterCallback.vec == applied);
+  }
+
+  SECTION("Everything is written after invalidate") {
+    mos.applyPatch(0, 2);
+    mos.invalidate();
+    writeRegisterCallback.vec.clear();
+    mos.applyPatch(0, 2);
+    REQUIRE(writeRegisterCallback.vec.size() == 6);
+  }
+}
+
+// Every reading is 3 ticks after the previous one
+struct SteppingClock {
+  uint32_t now() {
+    return time += 3;
+  }
+  uint32_t time = 0;
+};
+
+TEST_CASE("Instrumentation") {
+  Callback startClockCallback;
+  Callback resetCallback;
+  RegisterCallback writeRegisterCallback;
+  std::vector<uint8_t> bursts;
+  sid::ControllerStats stats;
+  typedef sid::InstrumentedController<MockController, SteppingClock> Instrumented;
+  MockController ctl(startClockCallback, resetCallback, writeRegisterCallback);
+  sid::Mos8561<Instrumented> mos(Instrumented(ctl, stats));
+  mos.start();
+  sid::Adsr adsr = {0x8, 0x3, 0xF, 0x4};
+
+  SECTION("Writes are counted per address and entry point") {
+    mos.setAdsr(1, adsr);
+    mos.setAdsr(1, adsr);
+    mos.playNote(0, 69, 127);
+    mos.setVolume(127);
+    REQUIRE(stats.totalWrites() == writeRegisterCallback.vec.size());
+    REQUIRE(stats.totalWrites() == 6);
+    REQUIRE(stats.writes(uint8_t(12)) == 1);
+    REQUIRE(stats.writes(uint8_t(13)) == 1);
+    REQUIRE(stats.writes(uint8_t(24)) == 1);
+    REQUIRE(stats.writes(sid::ApiCall::SetAdsr) == 2);
+    REQUIRE(stats.calls(sid::ApiCall::SetAdsr) == 2);
+    REQUIRE(stats.writes(sid::ApiCall::PlayNote) == 3);
+    REQUIRE(stats.writes(sid::ApiCall::SetVolume) == 1);
+    REQUIRE(stats.writes(sid::ApiCall::SetWaveform) == 0);
+  }
+
+  SECTION("Latency histogram") {
+    mos.setAdsr(1, adsr);
+    const sid::LatencyHistogram& latency = stats.writeLatency;
+    REQUIRE(latency.samples() == 2);
+    REQUIRE(latency.count(2) == 2);
+    REQUIRE(latency.total() == 6);
+    REQUIRE(latency.longest() == 3);
+    REQUIRE(stats.burstLatency.samples() == 0);
+
+    sid::LatencyHistogram histogram;
+    histogram.add(0);
+    histogram.add(1);
+    histogram.add(1000);
+    histogram.add(0xffffffff);
+    REQUIRE(histogram.count(0) == 1);
+    REQUIRE(histogram.count(1) == 1);
+    REQUIRE(histogram.count(10) == 1);
+    REQUIRE(histogram.count(sid::NUM_LATENCY_BUCKETS - 1) == 1);
+  }
+
+  SECTION("Transactions are counted as bursts of their commit") {
+    {
+      sid::Mos8561<Instrumented>::Transaction transaction(mos);
+      mos.setAdsr(0, adsr);
+      mos.setAdsr(2, adsr);
+    }
+    REQUIRE(stats.burstLatency.samples() == 1);
+    REQUIRE(stats.writes(sid::ApiCall::Commit) == 4);
+    REQUIRE(stats.writes(sid::ApiCall::SetAdsr) == 0);
+  }
+
+  SECTION("Reset") {
+    mos.setAdsr(1, adsr);
+    stats.reset();
+    REQUIRE(stats.totalWrites() == 0);
+    REQUIRE(stats.writes(uint8_t(12)) == 0);
+    REQUIRE(stats.calls(sid::ApiCall::SetAdsr) == 0);
+    REQUIRE(stats.writeLatency.samples() == 0);
+    mos.setAdsr(1, {0x1, 0x3, 0xF, 0x4});
+    REQUIRE(stats.totalWrites() == 1);
+  }
+}
+
+TEST_CASE("Sequencer") {
+  Callback startClockCallback;
+  Callback resetCallback;
+  RegisterCallback writeRegisterCallback;
+  MockController ctl(startClockCallback, resetCallback, writeRegisterCallback);
+  const sid::Event pattern[] = {
+    sid::Event::setWaveform(0, 0, sid::Waveform::Saw),
+    sid::Event::noteOn(0, 0, 69, 127),
+    sid::Event::noteOff(2, 0, 69),
+    sid::Event::noteOn(4, 0, 69, 127)
+  };
+  sid::SequenceOp ops[16];
+  sid::SequenceCompiler<> compiler(ops, 16);
+  REQUIRE(compiler.compile(pattern, 4));
+
+  SECTION("Compiling keeps only the writes that change something") {
+    REQUIRE(compiler.size() == 6);
+    REQUIRE(ops[0].tick == 0);
+    REQUIRE(ops[0].address == 4);
+    REQUIRE(ops[0].data == 0x20);
+    REQUIRE(ops[3].tick == 0);
+    REQUIRE(ops[3].data == 0x21);
+    REQUIRE(ops[4].tick == 2);
+    REQUIRE(ops[4].address == 4);
+    REQUIRE(ops[4].data == 0x20);
+    REQUIRE(ops[5].tick == 4);
+    REQUIRE(ops[5].data == 0x21);
+
+    sid::SequenceOp small[4];
+    sid::SequenceCompiler<> tooSmall(small, 4);
+    REQUIRE_FALSE(tooSmall.compile(pattern, 4));
+    REQUIRE(tooSmall.size() == 4);
+  }
+
+  sid::SequencePlayer<MockController> player(ctl);
+  player.setProgram(ops, compiler.size(), 6);
+  player.setTickInterval(10);
+
+  SECTION("Playback follows the ticks") {
+    player.start(100);
+    REQUIRE(player.poll(100));
+    REQUIRE(writeRegisterCallback.vec.size() == 4);
+    REQUIRE(player.poll(119));
+    REQUIRE(writeRegisterCallback.vec.size() == 4);
+    REQUIRE(player.poll(120));
+    REQUIRE(writeRegisterCallback.vec.size() == 5);
+    REQUIRE(player.poll(140));
+    REQUIRE(writeRegisterCallback.vec.size() == 6);
+    REQUIRE(player.poll(149));
+    REQUIRE_FALSE(player.poll(150));
+    REQUIRE_FALSE(player.poll(1000));
+    REQUIRE(writeRegisterCallback.vec.size() == 6);
+  }
+
+  SECTION("Looping") {
+    player.setIsLooping(true);
+    player.start(0);
+    REQUIRE(player.poll(59));
+    REQUIRE(writeRegisterCallback.vec.size() == 6);
+    REQUIRE(player.poll(60));
+    REQUIRE(writeRegisterCallback.vec.size() == 10);
+    REQUIRE(writeRegisterCallback.vec.at(6) == writeRegisterCallback.vec.at(0));
+    player.stop();
+    REQUIRE_FALSE(player.poll(1000));
+  }
+
+  SECTION("Tempo changes while playing") {
+    player.setProgram(ops, compiler.size(), 6, true);
+    player.start(0);
+    player.poll(0);
+    // The tick at 10 is already scheduled, the ones after it come faster
+    player.setTickInterval(5);
+    REQUIRE(player.poll(15));
+    REQUIRE(writeRegisterCallback.vec.size() == 5);
+    REQUIRE(player.poll(25));
+    REQUIRE(writeRegisterCallback.vec.size() == 6);
+    REQUIRE_FALSE(player.poll(30));
+  }
+}
+
+TEST_CASE("Mos8561 Filter and Control Bits") {
+  Callback startClockCallback;
+  Callback resetCallback;
+  RegisterCallback writeRegisterCallback;
+  MockController ctl(startClockCallback, resetCallback, writeRegisterCallback);
+  sid::Mos8561<MockController> mos(ctl);
+  mos.start();
+
+  SECTION("Filter cutoff") {
+    mos.setFilterCutoff(0x123);
+    REQUIRE(writeRegisterCallback.vec.size() == 2);
+    REQUIRE(writeRegisterCallback.vec.at(0) == std::make_pair<uint8_t, uint8_t>(21, 0x03));
+    REQUIRE(writeRegisterCallback.vec.at(1) == std::make_pair<uint8_t, uint8_t>(22, 0x24));
+    REQUIRE(mos.filterCutoffValue() == 0x123);
+    writeRegisterCallback.vec.clear();
+    // A sweep writes one register per step, two where the upper bits change
+    for (uint16_t cutoff = 0x124; cutoff <= 0x223; ++cutoff) {
+      mos.setFilterCutoff(cutoff);
+    }
+    REQUIRE(writeRegisterCallback.vec.size() == 256 + 32);
+  }
+
+  SECTION("Resonance shares its register with the routing") {
+    mos.setFilterIsEnabled(0, true);
+    mos.setFilterResonance(0xA);
+    REQUIRE(writeRegisterCallback.vec.back() == std::make_pair<uint8_t, uint8_t>(23, 0xA1));
+    mos.setFilterIsEnabled(1, true);
+    REQUIRE(writeRegisterCallback.vec.back() == std::make_pair<uint8_t, uint8_t>(23, 0xA3));
+    REQUIRE(writeRegisterCallback.vec.size() == 3);
+  }
+
+  SECTION("Mode shares its register with the volume") {
+    mos.setVolume(127);
+    REQUIRE(writeRegisterCallback.vec.back() == std::make_pair<uint8_t, uint8_t>(24, 0x0F));
+    mos.setFilterMode(sid::FilterMode::LowPass | sid::FilterMode::HighPass);
+    REQUIRE(writeRegisterCallback.vec.back() == std::make_pair<uint8_t, uint8_t>(24, 0x5F));
+    mos.setVoice3IsMuted(true);
+    REQUIRE(writeRegisterCallback.vec.back() == std::make_pair<uint8_t, uint8_t>(24, 0xDF));
+    mos.setVolume(0);
+    REQUIRE(writeRegisterCallback.vec.back() == std::make_pair<uint8_t, uint8_t>(24, 0xD0));
+    REQUIRE(writeRegisterCallback.vec.size() == 4);
+  }
+
+  SECTION("Sync, ring modulation and test bits") {
+    mos.setWaveform(1, sid::Waveform::Triangle);
+    mos.setRingModulation(1, true);
+    REQUIRE(writeRegisterCallback.vec.back() == std::make_pair<uint8_t, uint8_t>(11, 0x14));
+    mos.playNote(1, 60, 127);
+    REQUIRE(writeRegisterCallback.vec.back() == std::make_pair<uint8_t, uint8_t>(11, 0x15));
+    mos.setSync<1>(true);
+    REQUIRE(writeRegisterCallback.vec.back() == std::make_pair<uint8_t, uint8_t>(11, 0x17));
+    mos.setTest(1, true);
+    REQUIRE(writeRegisterCallback.vec.back() == std::make_pair<uint8_t, uint8_t>(11, 0x1F));
+    writeRegisterCallback.vec.clear();
+    mos.setTest<1>(true);
+    REQUIRE(writeRegisterCallback.vec.size() == 0);
+    mos.setRingModulation<1>(false);
+    mos.setSync(1, false);
+    mos.setTest(1, false);
+    REQUIRE(writeRegisterCallback.vec.back() == std::make_pair<uint8_t, uint8_t>(11, 0x11));
+  }
+
+  SECTION("Patches carry sync and ring modulation") {
+    const sid::Patch patch = sid::makePatch(sid::Waveform::Triangle, {0, 0, 0, 0}, 0, false,
+      true, true);
+    REQUIRE(patch.waveformFilter == 0x16);
+    mos.setTest(2, true);
+    mos.applyPatch(2, patch);
+    REQUIRE(writeRegisterCallback.vec.back() == std::make_pair<uint8_t, uint8_t>(18, 0x1E));
+  }
+}
+
+TEST_CASE("Emulator Voice 3 Readback") {
+  sid::Emulator emu(44100);
+  sid::EmulatedController ctl(emu);
+  sid::Mos8561<sid::EmulatedController> mos(ctl);
+  mos.start();
+  mos.setVoice3IsMuted(true);
+  mos.setAdsr(2, {0, 0, 0xF, 0});
+  mos.setWaveform(2, sid::Waveform::Saw);
+  float block[sid::Emulator::BLOCK_SIZE];
+
+  SECTION("Nothing before a note") {
+    emu.render(block, sid::Emulator::BLOCK_SIZE);
+    REQUIRE(mos.envelope3() == 0);
+    // Read-only registers cannot be written
+    ctl.writeRegister(sid::ENV3, 0x55);
+    REQUIRE(mos.envelope3() == 0);
+  }
+
+  SECTION("OSC3 and ENV3 follow voice 3") {
+    // A slow saw as an LFO, about 8 Hz, rendered for half a cycle
+    mos.playNote(2, 0, 127);
+    std::vector<uint8_t> osc;
+    for (int i = 0; i < 40; ++i) {
+      emu.render(block, sid::Emulator::BLOCK_SIZE);
+      osc.push_back(mos.oscillator3());
+    }
+    REQUIRE(mos.envelope3() == 255);
+    REQUIRE(osc.back() > osc.front());
+    REQUIRE(std::is_sorted(osc.begin(), osc.end()));
+    // Muted voice 3 is not heard
+    REQUIRE(std::fabs(block[0]) < 1e-6f);
+  }
+}